@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <boost/beast/core.hpp>
+#include <boost/asio.hpp>
+
+#include <beast_machine/client_session.hpp>
+#include <beast_machine/io_backend.hpp>
+#include <beast_machine/server_session.hpp>
+
+namespace beast = boost::beast;   // from <boost/beast.hpp>
+namespace net = boost::asio;      // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+using local = net::local::stream_protocol; // from <boost/asio/local/stream_protocol.hpp>
+
+// Compares the transports and Asio backends, the latency by playing ping pong with small messages
+// and the throughput by streaming large messages in chunks
+namespace bench
+{
+    // Report a failure
+    struct fail
+    {
+        void operator()(std::error_code ec, char const* what)
+        {
+            std::cerr << what << ": " << ec.message() << "\n";
+            std::exit(EXIT_FAILURE);
+        }
+    };
+
+    enum class environment
+    {
+        client,
+        server
+    };
+
+    struct config
+    {
+        static inline std::size_t message_count = 20000;
+        static inline std::size_t message_size = 64;
+        static inline std::size_t stream_size = 256 << 20;
+        static inline std::size_t stream_message_size = 4 << 20;
+        static inline std::size_t chunk_size = 64 << 10;
+    };
+
+    template<environment env>
+    class ping_pong_task
+    {
+        std::size_t _remaining = config::message_count;
+
+    public:
+        static constexpr bool is_server = env == environment::server;
+
+        beast_machine::callback_return callback(beast::flat_buffer& buffer, size_t& readable_bytes,
+                                                bool message_read_complete)
+        {
+            boost::ignore_unused(message_read_complete);
+
+            // server echoes every message back, the client ends the conversation
+            if constexpr (is_server)
+            {
+                if (readable_bytes == 0)
+                {
+                    return beast_machine::callback_return(beast_machine::callback_result::read, std::string());
+                }
+                return beast_machine::callback_return(beast_machine::callback_result::write_complete,
+                                                      beast::buffers_to_string(buffer.data()));
+            }
+            else
+            {
+                if (readable_bytes != 0)
+                {
+                    --_remaining;
+                }
+                if (_remaining == 0)
+                {
+                    return beast_machine::callback_return(beast_machine::callback_result::close, std::string());
+                }
+                return beast_machine::callback_return(beast_machine::callback_result::write_complete,
+                                                      std::string(config::message_size, 'x'));
+            }
+        }
+    };
+
+    template<environment env>
+    class bulk_stream_task
+    {
+        std::size_t _remaining = config::stream_size;
+        std::size_t _message_written = 0;
+
+    public:
+        static constexpr bool is_server = env == environment::server;
+
+        beast_machine::callback_return callback(beast::flat_buffer& buffer, size_t& readable_bytes,
+                                                bool message_read_complete)
+        {
+            boost::ignore_unused(buffer, message_read_complete);
+
+            // client streams messages in chunks, the server acknowledges each message once it has all of it
+            if constexpr (is_server)
+            {
+                if (readable_bytes != 0 && message_read_complete)
+                {
+                    return beast_machine::callback_return(
+                        beast_machine::callback_result::write_complete_async_read, "ok");
+                }
+                return beast_machine::callback_return(beast_machine::callback_result::need_more_reading,
+                                                      std::string());
+            }
+            else
+            {
+                if (readable_bytes != 0 && _remaining == 0)
+                {
+                    return beast_machine::callback_return(beast_machine::callback_result::close, std::string());
+                }
+
+                auto size = std::min({_remaining, config::chunk_size, config::stream_message_size - _message_written});
+                _remaining -= size;
+                _message_written += size;
+
+                auto result = beast_machine::callback_result::need_more_writing;
+                if (_remaining == 0 || _message_written == config::stream_message_size)
+                {
+                    result = beast_machine::callback_result::write_complete;
+                    _message_written = 0;
+                }
+                return beast_machine::callback_return(result, std::string(size, 'x'));
+            }
+        }
+    };
+
+    // Runs one conversation and returns how long it took
+    template<template<environment> class Task, class Protocol>
+    std::chrono::duration<double> run(typename Protocol::endpoint endpoint)
+    {
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+        std::make_shared<beast_machine::server::listener<Task<environment::server>, fail, Protocol>>(server_ioc,
+                                                                                                   endpoint, true, f)
+            ->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc {1};
+
+        auto start = std::chrono::steady_clock::now();
+        std::make_shared<beast_machine::client::session<Task<environment::client>, fail, Protocol>>(client_ioc, f)
+            ->run(endpoint, "localhost", "/");
+        client_ioc.run();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        t.join();
+        return elapsed;
+    }
+
+    // the best of a few runs is the least disturbed by the rest of the machine
+    template<template<environment> class Task, class Protocol>
+    std::chrono::duration<double> best_of(typename Protocol::endpoint endpoint, int runs)
+    {
+        std::chrono::duration<double> best = run<Task, Protocol>(endpoint);
+        for (int i = 1; i < runs; i++)
+        {
+            best = std::min(best, run<Task, Protocol>(endpoint));
+        }
+        return best;
+    }
+
+    template<class Protocol> void report(char const* name, typename Protocol::endpoint endpoint, int runs)
+    {
+        auto ping_pong = best_of<ping_pong_task, Protocol>(endpoint, runs);
+        auto stream = best_of<bulk_stream_task, Protocol>(endpoint, runs);
+
+        auto round_trips = static_cast<double>(config::message_count);
+        auto megabytes = static_cast<double>(config::stream_size) / (1 << 20);
+        std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(12) << round_trips / ping_pong.count() << " round trips/s" << std::setprecision(2)
+                  << std::setw(10) << ping_pong.count() * 1e6 / round_trips << " us/round trip"
+                  << std::setprecision(0) << std::setw(10) << megabytes / stream.count() << " MiB/s\n";
+    }
+} // namespace bench
+
+int main(int argc, char* argv[])
+{
+    // Usage: bench_beast_machine [message count] [message size] [stream size in MiB]
+    if (argc > 1)
+        bench::config::message_count = std::strtoul(argv[1], nullptr, 10);
+    if (argc > 2)
+        bench::config::message_size = std::strtoul(argv[2], nullptr, 10);
+    if (argc > 3)
+        bench::config::stream_size = std::strtoul(argv[3], nullptr, 10) << 20;
+
+    auto const runs = 3;
+    auto const path = (std::filesystem::temp_directory_path() / "beast_machine_bench.sock").string();
+
+    std::cout << beast_machine::to_string(beast_machine::current_io_backend()) << ": "
+              << bench::config::message_count << " messages of " << bench::config::message_size << " bytes, "
+              << (bench::config::stream_size >> 20) << " MiB streamed in messages of "
+              << (bench::config::stream_message_size >> 20) << " MiB written in chunks of "
+              << (bench::config::chunk_size >> 10) << " KiB\n";
+
+    bench::report<tcp>("tcp", tcp::endpoint {net::ip::make_address("127.0.0.1"), 8090}, runs);
+    bench::report<local>("unix", local::endpoint {path}, runs);
+
+    std::filesystem::remove(path);
+    return EXIT_SUCCESS;
+}
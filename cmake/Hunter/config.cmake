@@ -1,4 +1,4 @@
-hunter_config(Boost VERSION 1.70.0-p0)
+hunter_config(Boost VERSION 1.78.0)
 hunter_config(OpenSSL VERSION 1.1.0j)
 
 hunter_config(Catch2
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace beast_machine
+{
+    namespace server
+    {
+        // Limits on the work a listener takes on, a value of zero switches a limit off
+        struct admission_policy
+        {
+            // websocket sessions running at once, further handshakes are turned away
+            std::size_t max_sessions = 0;
+
+            // connections accepted whose first request has not yet been read,
+            // while at the limit new connections wait in the listen backlog
+            std::size_t max_handshakes = 0;
+
+            // new connections accepted per second, and how many may be accepted in one burst
+            double accept_rate = 0;
+            double accept_burst = 1;
+
+            // new websocket handshakes are turned away while the event loop runs later than this,
+            // or the memory in use is above max_memory, so that the sessions already running keep
+            // their latency. Conversations being resumed are still let in.
+            std::chrono::milliseconds max_loop_latency {0};
+            std::size_t max_memory = 0;
+
+            // how the memory in use is measured, defaults to the resident set size
+            std::function<std::size_t()> memory_usage;
+
+            // how often the event loop latency and memory are checked
+            std::chrono::milliseconds probe_interval {100};
+
+            // channels a client may have open at once on one multiplexed connection, which counts as
+            // a single session, further channels are closed as soon as they are opened
+            std::size_t max_channels = 256;
+        };
+
+        // Resident set size of this process in bytes, zero where it cannot be measured
+        inline std::size_t resident_memory()
+        {
+#ifdef __linux__
+            std::ifstream statm("/proc/self/statm");
+            std::size_t total = 0;
+            std::size_t resident = 0;
+            if (statm >> total >> resident)
+                return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+            return 0;
+        }
+
+        // Hands out rate tokens that refill continuously up to the size of the burst
+        class token_bucket
+        {
+            double rate_;
+            double burst_;
+            double tokens_;
+            std::chrono::steady_clock::time_point last_;
+
+        public:
+            token_bucket(double rate, double burst, std::chrono::steady_clock::time_point now)
+                : rate_(rate)
+                , burst_(std::max(burst, 1.0))
+                , tokens_(burst_)
+                , last_(now)
+            {
+            }
+
+            // Takes a token and returns zero, or returns how long until one is available
+            std::chrono::steady_clock::duration take(std::chrono::steady_clock::time_point now)
+            {
+                std::chrono::duration<double> elapsed = now - last_;
+                tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+                last_ = now;
+
+                if (tokens_ >= 1)
+                {
+                    tokens_ -= 1;
+                    return std::chrono::steady_clock::duration::zero();
+                }
+
+                return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>((1 - tokens_) / rate_));
+            }
+        };
+    } // namespace server
+} // namespace beast_machine
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <boost/assert.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <cstdlib>
 #include <functional>
@@ -9,6 +12,8 @@
 #include <memory>
 #include <string>
 #include "session.hpp"
+#include "multiplex.hpp"
+#include "resumable.hpp"
 
 namespace beast_machine
 {
@@ -20,14 +25,17 @@ namespace client
     namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
     namespace net = boost::asio;            // from <boost/asio.hpp>
     using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+    using local = net::local::stream_protocol; // from <boost/asio/local/stream_protocol.hpp>
 
     // Sends a WebSocket message and prints the response
-    template<class T, class FailSync>
-    class session : public std::enable_shared_from_this<session<T, FailSync>>, public T
+    // Protocol is either tcp or local for unix domain sockets
+    template<class T, class FailSync, class Protocol = tcp>
+    class session : public std::enable_shared_from_this<session<T, FailSync, Protocol>>, public T
     {
         tcp::resolver _resolver;
-        websocket::stream<beast::tcp_stream> _ws;
+        websocket::stream<beast::basic_stream<Protocol>> _ws;
         beast::flat_buffer _buffer;
+        std::string _write_buffer;
         std::string _host;
         std::string _target;
         std::shared_ptr<FailSync> _fail_sync;
@@ -45,13 +53,33 @@ namespace client
         // Start the asynchronous operation
         void run(char const* host, char const* port, char const* target)
         {
+            static_assert(std::is_same_v<Protocol, tcp>, "only tcp endpoints can be resolved");
+
             // Save these for later
             _host = host;
             _target = target;
 
             // Look up the domain name
             _resolver.async_resolve(
-                host, port, beast::bind_front_handler(&session::on_resolve, session<T, FailSync>::shared_from_this()));
+                host, port,
+                beast::bind_front_handler(&session::on_resolve, session<T, FailSync, Protocol>::shared_from_this()));
+        }
+
+        // Start the asynchronous operation on a known endpoint, e.g. the path of a unix domain socket,
+        // host is only used for the Host field of the handshake
+        void run(typename Protocol::endpoint endpoint, char const* host, char const* target)
+        {
+            // Save these for later
+            _host = host;
+            _target = target;
+
+            // Set the timeout for the operation
+            beast::get_lowest_layer(_ws).expires_after(std::chrono::seconds(30));
+
+            // Make the connection on the endpoint
+            beast::get_lowest_layer(_ws).async_connect(
+                endpoint,
+                beast::bind_front_handler(&session::on_connect, session<T, FailSync, Protocol>::shared_from_this()));
         }
 
         void on_resolve(beast::error_code ec, tcp::resolver::results_type results)
@@ -64,10 +92,16 @@ namespace client
 
             // Make the connection on the IP address we get from a lookup
             beast::get_lowest_layer(_ws).async_connect(
-                results, beast::bind_front_handler(&session::on_connect, session<T, FailSync>::shared_from_this()));
+                results, beast::bind_front_handler(&session::on_resolved_connect,
+                                                   session<T, FailSync, Protocol>::shared_from_this()));
+        }
+
+        void on_resolved_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+        {
+            on_connect(ec);
         }
 
-        void on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+        void on_connect(beast::error_code ec)
         {
             if (ec)
                 return fail(ec, "connect");
@@ -87,7 +121,7 @@ namespace client
             // Perform the websocket handshake
             _ws.async_handshake(
                 _host, _target,
-                beast::bind_front_handler(&session::on_handshake, session<T, FailSync>::shared_from_this()));
+                beast::bind_front_handler(&session::on_handshake, session<T, FailSync, Protocol>::shared_from_this()));
         }
 
         void process_message(size_t bytes)
@@ -98,6 +132,9 @@ namespace client
 
                 _buffer.consume(_buffer.size());
 
+                // the message has to outlive the write, which may not complete before the call returns
+                _write_buffer = std::move(std::get<1>(ret));
+
                 switch (std::get<0>(ret))
                 {
                 case callback_result::need_more_reading:
@@ -106,21 +143,22 @@ namespace client
                     return;
                 case callback_result::need_more_writing:
                     // Send the message
-                    _ws.async_write_some(false, net::buffer(std::get<1>(ret)),
+                    _ws.async_write_some(false, net::buffer(_write_buffer),
                                          beast::bind_front_handler(&session::on_write_contunue,
-                                                                   session<T, FailSync>::shared_from_this()));
+                                                                   session<T, FailSync, Protocol>::shared_from_this()));
                     return;
                 case callback_result::write_complete:
                     // Send the message
                     _ws.async_write_some(
-                        true, net::buffer(std::get<1>(ret)),
-                        beast::bind_front_handler(&session::on_write, session<T, FailSync>::shared_from_this()));
+                        true, net::buffer(_write_buffer),
+                        beast::bind_front_handler(&session::on_write,
+                                                  session<T, FailSync, Protocol>::shared_from_this()));
                     return;
                 case callback_result::write_complete_async_read:
                     // Send the message
-                    _ws.async_write_some(true, net::buffer(std::get<1>(ret)),
+                    _ws.async_write_some(true, net::buffer(_write_buffer),
                                          beast::bind_front_handler(&session::on_write_complete_async_read,
-                                                                   session<T, FailSync>::shared_from_this()));
+                                                                   session<T, FailSync, Protocol>::shared_from_this()));
                     return;
                 case callback_result::close:
                     break;
@@ -140,7 +178,8 @@ namespace client
 
             // Close the WebSocket connection
             _ws.async_close(websocket::close_code::normal,
-                            beast::bind_front_handler(&session::on_close, session<T, FailSync>::shared_from_this()));
+                            beast::bind_front_handler(&session::on_close,
+                                                      session<T, FailSync, Protocol>::shared_from_this()));
         }
 
         void on_handshake(beast::error_code ec)
@@ -153,14 +192,17 @@ namespace client
 
         void do_read_blob()
         {
+            _buffer.reserve(blob_read_size);
+
             // Read a message into our buffer
             _ws.async_read_some(_buffer, _buffer.capacity(),
-                                beast::bind_front_handler(&session::on_read, session<T, FailSync>::shared_from_this()));
+                                beast::bind_front_handler(&session::on_read,
+                                                          session<T, FailSync, Protocol>::shared_from_this()));
         }
 
         void on_read(beast::error_code ec, std::size_t bytes_transferred)
         {
-            REQUIRE(_buffer.size() == bytes_transferred); // NOLINT
+            BOOST_ASSERT(_buffer.size() == bytes_transferred); // NOLINT
             // boost::ignore_unused(bytes_transferred);
 
             if (ec)
@@ -177,8 +219,8 @@ namespace client
                 return fail(ec, "write");
 
             // Read a message into our buffer
-            _ws.async_read(_buffer,
-                           beast::bind_front_handler(&session::on_read, session<T, FailSync>::shared_from_this()));
+            _ws.async_read(_buffer, beast::bind_front_handler(&session::on_read,
+                                                              session<T, FailSync, Protocol>::shared_from_this()));
         }
 
         void on_write_complete_async_read(beast::error_code ec, std::size_t bytes_transferred)
@@ -211,5 +253,270 @@ namespace client
     private:
         template<class err_code> void fail(err_code ec, char const* what) { (*_fail_sync)(ec, what); }
     };
+
+    // Runs a number of T over one multiplexed websocket connection, each in a channel of its own,
+    // the connection is closed once every channel has finished
+    template<class T, class FailSync, class Protocol = tcp>
+    class mux_session : public mux::connection<T, FailSync, beast::basic_stream<Protocol>>
+    {
+        using base = mux::connection<T, FailSync, beast::basic_stream<Protocol>>;
+
+        tcp::resolver _resolver;
+        std::string _host;
+        std::string _target;
+        std::size_t _channels;
+        websocket::response_type _response;
+
+    public:
+        mux_session(net::io_context& ioc, std::shared_ptr<FailSync> fs, std::size_t channels)
+            : base(fs, true, net::make_strand(ioc))
+            , _resolver(net::make_strand(ioc))
+            , _channels(channels)
+        {
+        }
+
+        // Start the asynchronous operation
+        void run(char const* host, char const* port, char const* target)
+        {
+            static_assert(std::is_same_v<Protocol, tcp>, "only tcp endpoints can be resolved");
+
+            // Save these for later
+            _host = host;
+            _target = target;
+
+            // Look up the domain name
+            _resolver.async_resolve(host, port, beast::bind_front_handler(&mux_session::on_resolve, self()));
+        }
+
+        // Start the asynchronous operation on a known endpoint,
+        // host is only used for the Host field of the handshake
+        void run(typename Protocol::endpoint endpoint, char const* host, char const* target)
+        {
+            // Save these for later
+            _host = host;
+            _target = target;
+
+            // Set the timeout for the operation
+            beast::get_lowest_layer(this->ws_).expires_after(std::chrono::seconds(30));
+
+            // Make the connection on the endpoint
+            beast::get_lowest_layer(this->ws_).async_connect(
+                endpoint, beast::bind_front_handler(&mux_session::on_connect, self()));
+        }
+
+    private:
+        std::shared_ptr<mux_session> self() { return std::static_pointer_cast<mux_session>(this->shared_from_this()); }
+
+        void on_resolve(beast::error_code ec, tcp::resolver::results_type results)
+        {
+            if (ec)
+                return this->fail(ec, "resolve");
+
+            // Set the timeout for the operation
+            beast::get_lowest_layer(this->ws_).expires_after(std::chrono::seconds(30));
+
+            // Make the connection on the IP address we get from a lookup
+            beast::get_lowest_layer(this->ws_).async_connect(
+                results, beast::bind_front_handler(&mux_session::on_resolved_connect, self()));
+        }
+
+        void on_resolved_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+        {
+            on_connect(ec);
+        }
+
+        void on_connect(beast::error_code ec)
+        {
+            if (ec)
+                return this->fail(ec, "connect");
+
+            // Turn off the timeout on the tcp_stream, because
+            // the websocket stream has its own timeout system.
+            beast::get_lowest_layer(this->ws_).expires_never();
+
+            // Set suggested timeout settings for the websocket
+            this->ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+
+            // Ask the server for a multiplexed connection
+            this->ws_.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+                req.set(http::field::user_agent, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-async");
+                req.set(http::field::sec_websocket_protocol, mux::subprotocol);
+            }));
+
+            // Perform the websocket handshake
+            this->ws_.async_handshake(_response, _host, _target,
+                                      beast::bind_front_handler(&mux_session::on_handshake, self()));
+        }
+
+        void on_handshake(beast::error_code ec)
+        {
+            // the server is shedding load
+            if (ec && _response.result() == http::status::service_unavailable)
+                return this->fail(make_error_code(errc::server_overloaded), "handshake");
+
+            if (ec)
+                return this->fail(ec, "handshake");
+
+            // an older server will have accepted a plain websocket connection
+            if (_response[http::field::sec_websocket_protocol] != mux::subprotocol)
+                return this->fail(make_error_code(errc::multiplex_not_supported), "handshake");
+
+            this->start();
+
+            for (std::size_t i = 0; i < _channels; i++)
+                this->open_channel();
+        }
+    };
+
+    // Runs a T whose conversation carries on over a new connection when the current one drops,
+    // T must provide snapshot and restore, see resume::is_resumable
+    template<class T, class FailSync, class Protocol = tcp>
+    class resumable_session : public resume::connection<T, FailSync, beast::basic_stream<Protocol>>
+    {
+        using base = resume::connection<T, FailSync, beast::basic_stream<Protocol>>;
+
+        static_assert(resume::is_resumable_v<T>, "T needs snapshot and restore functions");
+
+        net::io_context& _ioc;
+        typename Protocol::endpoint _endpoint;
+        std::string _host;
+        std::string _target;
+        std::string _token;
+        int _attempt = 0;
+        bool _shed = false;
+        net::steady_timer _timer;
+        websocket::response_type _response;
+
+    public:
+        // The number of times in a row the session tries to reconnect before giving up
+        static constexpr int max_attempts = 5;
+
+        resumable_session(net::io_context& ioc, std::shared_ptr<FailSync> fs)
+            : base(fs, net::make_strand(ioc))
+            , _ioc(ioc)
+            , _timer(ioc)
+        {
+        }
+
+        // Carries on a dropped conversation, used when reconnecting
+        resumable_session(net::io_context& ioc, std::shared_ptr<FailSync> fs, typename Protocol::endpoint endpoint,
+                          std::string host, std::string target, std::string token, resume::state st, int attempt)
+            : base(fs, net::make_strand(ioc))
+            , _ioc(ioc)
+            , _endpoint(std::move(endpoint))
+            , _host(std::move(host))
+            , _target(std::move(target))
+            , _token(std::move(token))
+            , _attempt(attempt)
+            , _timer(ioc)
+        {
+            this->restore(std::move(st));
+        }
+
+        // Start the asynchronous operation on a known endpoint,
+        // host is only used for the Host field of the handshake
+        void run(typename Protocol::endpoint endpoint, char const* host, char const* target)
+        {
+            // Save these for later
+            _endpoint = endpoint;
+            _host = host;
+            _target = target;
+
+            do_connect();
+        }
+
+        // Drops the connection as if the network had failed, the conversation then resumes over a new one
+        void disconnect()
+        {
+            net::post(this->ws_.get_executor(), [self = self()] { self->drop({}, "disconnect"); });
+        }
+
+    protected:
+        void on_dropped(resume::state&& st, beast::error_code ec, char const* what) override
+        {
+            // the server has nothing to resume until the first handshake has completed,
+            // unless it turned that handshake away to shed load
+            if (_attempt >= max_attempts && _shed)
+                return this->fail(make_error_code(errc::server_overloaded), what);
+            if ((_token.empty() && !_shed) || _attempt >= max_attempts)
+                return this->fail(ec, what);
+
+            auto next = std::make_shared<resumable_session>(_ioc, this->fail_sync, _endpoint, _host, _target,
+                                                            _token, std::move(st), _attempt + 1);
+            next->retry();
+        }
+
+    private:
+        std::shared_ptr<resumable_session> self()
+        {
+            return std::static_pointer_cast<resumable_session>(this->shared_from_this());
+        }
+
+        void retry()
+        {
+            // back off a little more on each attempt
+            _timer.expires_after(std::chrono::milliseconds(100) * _attempt);
+            _timer.async_wait([self = self()](beast::error_code ec) {
+                if (!ec)
+                    self->do_connect();
+            });
+        }
+
+        void do_connect()
+        {
+            // Set the timeout for the operation
+            beast::get_lowest_layer(this->ws_).expires_after(std::chrono::seconds(30));
+
+            // Make the connection on the endpoint
+            beast::get_lowest_layer(this->ws_).async_connect(
+                _endpoint, beast::bind_front_handler(&resumable_session::on_connect, self()));
+        }
+
+        void on_connect(beast::error_code ec)
+        {
+            if (ec)
+                return this->drop(ec, "connect");
+
+            // Turn off the timeout on the tcp_stream, because
+            // the websocket stream has its own timeout system.
+            beast::get_lowest_layer(this->ws_).expires_never();
+
+            // Set suggested timeout settings for the websocket
+            this->ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+
+            // Ask for a resumable connection, and where to pick up if this is not the first
+            std::string point;
+            if (!_token.empty())
+                point = resume::to_string({_token, this->received()});
+
+            this->ws_.set_option(websocket::stream_base::decorator([point](websocket::request_type& req) {
+                req.set(http::field::user_agent, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-async");
+                req.set(http::field::sec_websocket_protocol, resume::subprotocol);
+                if (!point.empty())
+                    req.set(resume::header, point);
+            }));
+
+            // Perform the websocket handshake
+            this->ws_.async_handshake(_response, _host, _target,
+                                      beast::bind_front_handler(&resumable_session::on_handshake, self()));
+        }
+
+        void on_handshake(beast::error_code ec)
+        {
+            // the server is shedding load, try again later like after any other drop
+            _shed = ec && _response.result() == http::status::service_unavailable;
+            if (ec)
+                return this->drop(ec, "handshake");
+
+            auto point = resume::parse(_response[resume::header]);
+            if (_response[http::field::sec_websocket_protocol] != resume::subprotocol || !point)
+                return this->fail(make_error_code(errc::resume_not_supported), "handshake");
+
+            _token = point->token;
+            _attempt = 0;
+
+            this->start(point->received);
+        }
+    };
 } // namespace client
 } // namespace beast_machine
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <boost/asio/detail/config.hpp>
+
+namespace beast_machine
+{
+    // The Asio backend the sessions run on. Asio chooses it when it is compiled, linking the
+    // beast_machine_io_uring target instead of beast_machine switches it to io_uring.
+    enum class io_backend
+    {
+        io_uring,
+        epoll,
+        other
+    };
+
+    constexpr io_backend current_io_backend()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+        return io_backend::io_uring;
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+        return io_backend::epoll;
+#else
+        return io_backend::other;
+#endif
+    }
+
+    inline char const* to_string(io_backend backend)
+    {
+        switch (backend)
+        {
+        case io_backend::io_uring:
+            return "io_uring";
+        case io_backend::epoll:
+            return "epoll";
+        default:
+            return "other";
+        }
+    }
+} // namespace beast_machine
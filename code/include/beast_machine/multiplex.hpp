@@ -0,0 +1,446 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include "session.hpp"
+
+namespace beast_machine
+{
+    namespace mux
+    {
+        namespace beast = boost::beast;         // from <boost/beast.hpp>
+        namespace http = beast::http;           // from <boost/beast/http.hpp>
+        namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
+        namespace net = boost::asio;            // from <boost/asio.hpp>
+
+        // Clients ask for a multiplexed connection with this Sec-WebSocket-Protocol
+        constexpr char subprotocol[] = "beast-machine-mux";
+
+        // The number of frames a channel may send before the peer has to grant more credit
+        constexpr std::uint32_t window = 16;
+
+        // Every websocket message carries exactly one frame:
+        // | channel id (4 bytes, big endian) | frame_type (1 byte) | payload |
+        enum class frame_type : std::uint8_t
+        {
+            data,     // part of a message
+            data_end, // the last part of a message
+            credit,   // the payload is the number of frames (4 bytes, big endian) the receiver may now send
+            close     // the channel has finished
+        };
+
+        constexpr std::size_t header_size = 5;
+
+        inline std::string encode_frame(std::uint32_t channel, frame_type type, std::string const& payload)
+        {
+            std::string frame;
+            frame.reserve(header_size + payload.size());
+            detail::put_uint(frame, channel, 4);
+            frame.push_back(static_cast<char>(type));
+            frame += payload;
+            return frame;
+        }
+
+        inline std::string encode_credit(std::uint32_t channel, std::uint32_t frames)
+        {
+            std::string payload;
+            detail::put_uint(payload, frames, 4);
+            return encode_frame(channel, frame_type::credit, payload);
+        }
+
+        inline bool decode_header(net::const_buffer buffer, std::uint32_t& channel, frame_type& type)
+        {
+            if (buffer.size() < header_size)
+                return false;
+
+            auto data = static_cast<unsigned char const*>(buffer.data());
+            if (data[4] > static_cast<std::uint8_t>(frame_type::close))
+                return false;
+
+            channel = static_cast<std::uint32_t>(detail::get_uint(data, 4));
+            type = static_cast<frame_type>(data[4]);
+            return true;
+        }
+
+        // true if the upgrade request asks for a multiplexed connection
+        template<class Fields> bool is_requested(http::request_header<Fields> const& req)
+        {
+            for (auto const& protocol : http::token_list {req[http::field::sec_websocket_protocol]})
+            {
+                if (protocol == subprotocol)
+                    return true;
+            }
+            return false;
+        }
+
+        //------------------------------------------------------------------------------
+
+        // Runs one T per channel over a single websocket connection. A channel behaves like a session
+        // of its own, except that its messages are split into frames that are interleaved with those
+        // of the other channels. The client opens the channels and closes the connection once the
+        // last one has finished, the server creates a T when it sees the first frame of a new channel.
+        template<class T, class FailSync, class NextLayer>
+        class connection : public std::enable_shared_from_this<connection<T, FailSync, NextLayer>>
+        {
+            struct channel
+            {
+                enum class state
+                {
+                    starting,
+                    reading_message,
+                    reading_blob,
+                    writing
+                };
+
+                T task;
+                state st = state::starting;
+                callback_result after_write = callback_result::close;
+                std::string pending;                            // the frame waiting to be scheduled
+                bool message_done = true;                       // the last frame read ended a message
+                std::uint32_t send_credit = 0;                  // frames we may send before the peer grants more
+                std::uint32_t consumed = 0;                     // frames read since credit was last granted
+                std::deque<std::pair<std::string, bool>> inbox; // frames the task has not asked for yet
+                beast::flat_buffer buffer;
+            };
+
+            beast::flat_buffer read_buffer_;
+            std::map<std::uint32_t, channel> channels_;
+            std::deque<std::uint32_t> ready_;  // channels with a frame waiting, in the order they get written
+            std::deque<std::string> control_;  // credit and close frames go ahead of the data
+            std::string writing_;
+            std::uint32_t writing_channel_ = 0; // 0 when writing a control frame
+            bool write_in_progress_ = false;
+            bool closing_ = false;
+            bool opens_channels_;
+            std::uint32_t last_channel_ = 0;
+            std::size_t max_channels_ = 0;
+            std::shared_ptr<FailSync> fail_sync;
+
+        protected:
+            websocket::stream<NextLayer> ws_;
+
+            // opens_channels is true for the client end of the connection
+            template<class... Args>
+            connection(std::shared_ptr<FailSync> fs, bool opens_channels, Args&&... args)
+                : opens_channels_(opens_channels)
+                , fail_sync(std::move(fs))
+                , ws_(std::forward<Args>(args)...)
+            {
+                ws_.binary(true);
+            }
+
+            // Call once the handshake is complete
+            void start() { do_read(); }
+
+            // The server closes channels the client opens beyond this many at once, zero for no limit
+            void set_max_channels(std::size_t max_channels) { max_channels_ = max_channels; }
+
+            // Creates a new channel and gives its task the initial callback
+            void open_channel()
+            {
+                auto id = ++last_channel_;
+                auto& ch = add_channel(id);
+                process_message(id, ch, 0);
+            }
+
+            template<class err_code> void fail(err_code ec, char const* what) { (*fail_sync)(ec, what); }
+
+        private:
+            channel& add_channel(std::uint32_t id)
+            {
+                auto& ch = channels_.try_emplace(id).first->second;
+                ch.send_credit = window;
+                return ch;
+            }
+
+            void process_message(std::uint32_t id, channel& ch, size_t bytes)
+            {
+                callback_return ret;
+                try
+                {
+                    ret = ch.task.callback(ch.buffer, bytes, ch.message_done);
+                }
+                catch (std::logic_error& ex)
+                {
+                    fail(make_error_code(errc::unrecognised_state), ex.what());
+                    return close_channel(id);
+                }
+                catch (std::exception& ex)
+                {
+                    fail(make_error_code(errc::unexpected_exception), ex.what());
+                    return close_channel(id);
+                }
+
+                ch.buffer.consume(ch.buffer.size());
+
+                switch (std::get<0>(ret))
+                {
+                case callback_result::read:
+                    ch.st = channel::state::reading_message;
+                    return drain(id, ch);
+                case callback_result::need_more_reading:
+                    ch.st = channel::state::reading_blob;
+                    return drain(id, ch);
+                case callback_result::need_more_writing:
+                    return queue_frame(id, ch, frame_type::data, std::get<1>(ret), std::get<0>(ret));
+                case callback_result::write_complete:
+                case callback_result::write_complete_async_read:
+                    return queue_frame(id, ch, frame_type::data_end, std::get<1>(ret), std::get<0>(ret));
+                case callback_result::close:
+                    return close_channel(id);
+                default:
+                    fail(make_error_code(errc::unrecognised_state), "unexpected switch state");
+                    return close_channel(id);
+                }
+            }
+
+            // Hands the frames that have arrived to the task while it is waiting for them
+            void drain(std::uint32_t id, channel& ch)
+            {
+                while (!ch.inbox.empty()
+                       && (ch.st == channel::state::reading_message || ch.st == channel::state::reading_blob))
+                {
+                    auto frame = std::move(ch.inbox.front());
+                    ch.inbox.pop_front();
+
+                    auto size = frame.first.size();
+                    ch.buffer.commit(net::buffer_copy(ch.buffer.prepare(size), net::buffer(frame.first)));
+                    ch.message_done = frame.second;
+                    grant_credit(id, ch);
+
+                    // a full read waits for the end of the message
+                    if (ch.st == channel::state::reading_message && !ch.message_done)
+                        continue;
+
+                    auto bytes = ch.buffer.size();
+                    return process_message(id, ch, bytes);
+                }
+            }
+
+            void grant_credit(std::uint32_t id, channel& ch)
+            {
+                // credit goes back in batches to keep the control traffic down
+                if (++ch.consumed < window / 2)
+                    return;
+
+                control_.push_back(encode_credit(id, ch.consumed));
+                ch.consumed = 0;
+                do_write();
+            }
+
+            void queue_frame(std::uint32_t id, channel& ch, frame_type type, std::string const& payload,
+                             callback_result after_write)
+            {
+                ch.st = channel::state::writing;
+                ch.after_write = after_write;
+                ch.pending = encode_frame(id, type, payload);
+                ready_.push_back(id);
+                do_write();
+            }
+
+            void close_channel(std::uint32_t id)
+            {
+                remove_channel(id);
+                control_.push_back(encode_frame(id, frame_type::close, std::string()));
+                do_write();
+            }
+
+            void remove_channel(std::uint32_t id)
+            {
+                channels_.erase(id);
+                ready_.erase(std::remove(ready_.begin(), ready_.end(), id), ready_.end());
+            }
+
+            void do_write()
+            {
+                if (write_in_progress_ || closing_)
+                    return;
+
+                if (!control_.empty())
+                {
+                    writing_ = std::move(control_.front());
+                    control_.pop_front();
+                    writing_channel_ = 0;
+                }
+                else
+                {
+                    // round robin over the channels that have a frame waiting and the credit to send it
+                    auto it = std::find_if(ready_.begin(), ready_.end(),
+                                           [this](std::uint32_t id) { return channels_.at(id).send_credit != 0; });
+                    if (it == ready_.end())
+                    {
+                        // the client ends the connection once all of its conversations are over
+                        if (opens_channels_ && channels_.empty())
+                            close_connection(websocket::close_code::normal);
+                        return;
+                    }
+
+                    writing_channel_ = *it;
+                    ready_.erase(it);
+
+                    auto& ch = channels_.at(writing_channel_);
+                    --ch.send_credit;
+                    writing_ = std::move(ch.pending);
+                }
+
+                write_in_progress_ = true;
+                ws_.async_write(net::buffer(writing_),
+                                beast::bind_front_handler(&connection::on_write, connection::shared_from_this()));
+            }
+
+            void on_write(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                write_in_progress_ = false;
+
+                if (ec)
+                    return fail(ec, "write");
+
+                auto it = channels_.find(writing_channel_);
+                if (writing_channel_ != 0 && it != channels_.end())
+                {
+                    auto& ch = it->second;
+                    switch (ch.after_write)
+                    {
+                    case callback_result::need_more_writing:
+                        process_message(writing_channel_, ch, 0);
+                        break;
+                    case callback_result::write_complete:
+                        ch.st = channel::state::reading_message;
+                        drain(writing_channel_, ch);
+                        break;
+                    case callback_result::write_complete_async_read:
+                        ch.st = channel::state::reading_blob;
+                        drain(writing_channel_, ch);
+                        break;
+                    default:
+                        break;
+                    }
+                }
+
+                do_write();
+            }
+
+            void do_read()
+            {
+                ws_.async_read(read_buffer_,
+                               beast::bind_front_handler(&connection::on_read, connection::shared_from_this()));
+            }
+
+            void on_read(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                // This indicates that the connection was closed, a read that is
+                // pending while we close the connection ourselves gets cancelled
+                if (ec == websocket::error::closed || (closing_ && ec == net::error::operation_aborted))
+                {
+                    // conversations that were still running have been cut short by the peer
+                    if (!closing_ && !channels_.empty())
+                    {
+                        auto const& r = ws_.reason().reason;
+                        std::string reason(r.data(), r.size());
+                        fail(ec, reason.empty() ? "closed" : reason.c_str());
+                    }
+                    return;
+                }
+
+                if (ec)
+                    return fail(ec, "read");
+
+                std::uint32_t id = 0;
+                frame_type type = frame_type::data;
+                auto data = read_buffer_.data();
+                if (!decode_header(data, id, type) || id == 0)
+                {
+                    fail(make_error_code(errc::invalid_frame), "read");
+                    return close_connection(websocket::close_code::protocol_error);
+                }
+
+                std::string payload(static_cast<char const*>(data.data()) + header_size, data.size() - header_size);
+                read_buffer_.consume(read_buffer_.size());
+
+                on_frame(id, type, std::move(payload));
+
+                do_read();
+            }
+
+            void on_frame(std::uint32_t id, frame_type type, std::string payload)
+            {
+                auto it = channels_.find(id);
+                switch (type)
+                {
+                case frame_type::data:
+                case frame_type::data_end:
+                    if (it == channels_.end())
+                    {
+                        // frames still in flight for a channel that has already closed are dropped,
+                        // channel ids only ever go up so anything newer is a channel the client has opened
+                        if (opens_channels_ || id <= last_channel_)
+                            return;
+
+                        last_channel_ = id;
+
+                        // the rest of this channel's frames are dropped as it is already closed
+                        if (max_channels_ != 0 && channels_.size() >= max_channels_)
+                        {
+                            control_.push_back(encode_frame(id, frame_type::close, std::string()));
+                            return do_write();
+                        }
+
+                        auto& ch = add_channel(id);
+                        ch.inbox.emplace_back(std::move(payload), type == frame_type::data_end);
+                        return process_message(id, ch, 0);
+                    }
+
+                    // the peer has ignored our flow control
+                    if (it->second.inbox.size() >= window)
+                    {
+                        fail(make_error_code(errc::invalid_frame), "flow control");
+                        return close_channel(id);
+                    }
+
+                    it->second.inbox.emplace_back(std::move(payload), type == frame_type::data_end);
+                    return drain(id, it->second);
+                case frame_type::credit:
+                    if (it != channels_.end() && payload.size() == 4)
+                    {
+                        it->second.send_credit += static_cast<std::uint32_t>(
+                            detail::get_uint(reinterpret_cast<unsigned char const*>(payload.data()), 4));
+                    }
+                    return do_write();
+                case frame_type::close:
+                    // the client closes its channels itself once its task is done, so a close from
+                    // the server means the channel was refused or its conversation was cut short
+                    if (opens_channels_ && it != channels_.end())
+                        fail(make_error_code(errc::channel_refused), "channel");
+                    remove_channel(id);
+                    return do_write();
+                }
+            }
+
+            void close_connection(websocket::close_code code)
+            {
+                if (closing_)
+                    return;
+
+                closing_ = true;
+                ws_.async_close(code, beast::bind_front_handler(&connection::on_close, connection::shared_from_this()));
+            }
+
+            void on_close(beast::error_code ec)
+            {
+                if (ec)
+                    return fail(ec, "close");
+            }
+        };
+    } // namespace mux
+} // namespace beast_machine
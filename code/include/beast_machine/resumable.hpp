@@ -0,0 +1,639 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include "session.hpp"
+
+namespace beast_machine
+{
+    namespace resume
+    {
+        namespace beast = boost::beast;         // from <boost/beast.hpp>
+        namespace http = beast::http;           // from <boost/beast/http.hpp>
+        namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
+        namespace net = boost::asio;            // from <boost/asio.hpp>
+
+        // Clients ask for a resumable connection with this Sec-WebSocket-Protocol
+        constexpr char subprotocol[] = "beast-machine-resume";
+
+        // Carries "<token> <last sequence number received>" in both directions of the handshake,
+        // a client leaves it out of the request to start a new conversation
+        constexpr char header[] = "X-Beast-Machine-Resume";
+
+        // A receiver that has nothing to send acknowledges after this many frames
+        constexpr std::uint64_t ack_interval = 16;
+
+        // Every websocket message carries exactly one frame:
+        // | frame_type (1 byte) | sequence number (8 bytes) | acknowledged sequence number (8 bytes) | payload |
+        enum class frame_type : std::uint8_t
+        {
+            data,     // part of a message
+            data_end, // the last part of a message
+            ack       // only acknowledges, has no sequence number or payload
+        };
+
+        constexpr std::size_t header_size = 17;
+
+        inline std::string encode_frame(frame_type type, std::uint64_t seq, std::uint64_t ack,
+                                        std::string const& payload)
+        {
+            std::string frame;
+            frame.reserve(header_size + payload.size());
+            frame.push_back(static_cast<char>(type));
+            detail::put_uint(frame, seq, 8);
+            detail::put_uint(frame, ack, 8);
+            frame += payload;
+            return frame;
+        }
+
+        inline bool decode_header(net::const_buffer buffer, frame_type& type, std::uint64_t& seq, std::uint64_t& ack)
+        {
+            if (buffer.size() < header_size)
+                return false;
+
+            auto data = static_cast<unsigned char const*>(buffer.data());
+            if (data[0] > static_cast<std::uint8_t>(frame_type::ack))
+                return false;
+
+            type = static_cast<frame_type>(data[0]);
+            seq = detail::get_uint(data + 1, 8);
+            ack = detail::get_uint(data + 9, 8);
+            return true;
+        }
+
+        // A state machine can be resumed if it provides
+        //   std::string snapshot() const
+        //   void restore(std::string const&)
+        template<class T, class = void> struct is_resumable : std::false_type
+        {
+        };
+
+        template<class T>
+        struct is_resumable<T,
+                            std::void_t<decltype(std::declval<T const&>().snapshot()),
+                                        decltype(std::declval<T&>().restore(std::declval<std::string const&>()))>>
+            : std::true_type
+        {
+        };
+
+        template<class T> constexpr bool is_resumable_v = is_resumable<T>::value;
+
+        // true if the upgrade request asks for a resumable connection
+        template<class Fields> bool is_requested(http::request_header<Fields> const& req)
+        {
+            for (auto const& protocol : http::token_list {req[http::field::sec_websocket_protocol]})
+            {
+                if (protocol == subprotocol)
+                    return true;
+            }
+            return false;
+        }
+
+        // The value of the resume header
+        struct resume_point
+        {
+            std::string token;
+            std::uint64_t received = 0;
+        };
+
+        inline std::string to_string(resume_point const& point)
+        {
+            return point.token + " " + std::to_string(point.received);
+        }
+
+        inline std::optional<resume_point> parse(beast::string_view value)
+        {
+            std::istringstream is {std::string(value)};
+            resume_point point;
+            if (!(is >> point.token >> point.received))
+                return std::nullopt;
+            return point;
+        }
+
+        // Everything needed to carry on a conversation over a new connection
+        struct state
+        {
+            enum class phase
+            {
+                starting,
+                reading_message,
+                reading_blob,
+                writing
+            };
+
+            std::string snapshot;
+            phase ph = phase::starting;
+            callback_result after_write = callback_result::close;
+            std::uint64_t next_send = 1;
+            std::uint64_t received = 0;
+            bool message_done = true;
+            bool close_requested = false;                                          // the task has finished
+            std::string partial;                                                   // part of a message already read
+            std::deque<std::pair<std::string, bool>> inbox;                        // frames not yet given to T
+            std::deque<std::tuple<std::uint64_t, frame_type, std::string>> unacked; // frames the peer may not have
+        };
+
+        // Holds the state of dropped server connections until the client comes back or the retention expires.
+        // It also knows the conversations that are still running, because a client can come back before the
+        // server has noticed its old connection drop, which after a network failure can take minutes.
+        class store
+        {
+        public:
+            // Drops a running conversation, which puts its state in the store, and then calls done
+            using evict_handler = std::function<void(std::function<void()> done)>;
+
+        private:
+            struct entry
+            {
+                std::chrono::steady_clock::time_point expires;
+                state st;
+            };
+
+            struct live_entry
+            {
+                std::uint64_t id;
+                evict_handler evict;
+            };
+
+            std::mutex mutex_;
+            std::map<std::string, entry> entries_;
+            std::map<std::string, live_entry> live_;
+            std::uint64_t last_live_id_ = 0;
+            std::chrono::seconds retention_;
+            std::size_t capacity_;
+            std::random_device random_;
+
+        public:
+            explicit store(std::chrono::seconds retention, std::size_t capacity = 1000)
+                : retention_(retention)
+                , capacity_(capacity)
+            {
+            }
+
+            // A token lets whoever holds it take the conversation over, so every word comes straight from
+            // the random device rather than from a generator that could be predicted from other tokens
+            std::string make_token()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::ostringstream os;
+                os << std::hex << std::setfill('0');
+                for (int i = 0; i < 4; i++)
+                    os << std::setw(8) << static_cast<std::uint32_t>(random_());
+                return os.str();
+            }
+
+            void put(std::string const& token, state st)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto now = std::chrono::steady_clock::now();
+                prune(now);
+
+                // make room by dropping the conversation closest to expiring
+                if (entries_.size() >= capacity_ && !entries_.empty())
+                {
+                    auto oldest = std::min_element(entries_.begin(), entries_.end(), [](auto const& a, auto const& b) {
+                        return a.second.expires < b.second.expires;
+                    });
+                    entries_.erase(oldest);
+                }
+
+                if (capacity_ != 0)
+                    entries_[token] = entry {now + retention_, std::move(st)};
+            }
+
+            std::optional<state> take(std::string const& token)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                prune(std::chrono::steady_clock::now());
+
+                auto it = entries_.find(token);
+                if (it == entries_.end())
+                    return std::nullopt;
+
+                auto st = std::move(it->second.st);
+                entries_.erase(it);
+                return st;
+            }
+
+            // Records a running conversation, returns the id to detach it with
+            std::uint64_t attach(std::string const& token, evict_handler evict)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto id = ++last_live_id_;
+                live_[token] = live_entry {id, std::move(evict)};
+                return id;
+            }
+
+            // The conversation is no longer running, unless it has been attached again since
+            void detach(std::string const& token, std::uint64_t id)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = live_.find(token);
+                if (it != live_.end() && it->second.id == id)
+                    live_.erase(it);
+            }
+
+            // Drops the running conversation so that its state can be taken, returns false if there is none.
+            // done may be called on another thread.
+            bool evict(std::string const& token, std::function<void()> done)
+            {
+                evict_handler evict;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = live_.find(token);
+                    if (it == live_.end())
+                        return false;
+
+                    evict = std::move(it->second.evict);
+                    live_.erase(it);
+                }
+
+                evict(std::move(done));
+                return true;
+            }
+
+        private:
+            void prune(std::chrono::steady_clock::time_point now)
+            {
+                for (auto it = entries_.begin(); it != entries_.end();)
+                {
+                    if (it->second.expires <= now)
+                        it = entries_.erase(it);
+                    else
+                        ++it;
+                }
+            }
+        };
+
+        //------------------------------------------------------------------------------
+
+        // Runs a T like a plain session, except that every frame carries a sequence number and acknowledges
+        // the frames received from the peer. Frames are kept until they are acknowledged so that when the
+        // connection drops the conversation can carry on over a new one from where it left off. What happens
+        // to the state of a dropped connection is up to the derived class.
+        template<class T, class FailSync, class NextLayer>
+        class connection : public std::enable_shared_from_this<connection<T, FailSync, NextLayer>>
+        {
+            struct outgoing
+            {
+                frame_type type;
+                std::uint64_t seq;
+                std::string payload;
+                bool continues; // the task carries on once this frame has been written
+            };
+
+            T task_;
+            state::phase phase_ = state::phase::starting;
+            callback_result after_write_ = callback_result::close;
+            std::uint64_t next_send_ = 1;
+            std::uint64_t received_ = 0;
+            std::uint64_t since_ack_ = 0;
+            bool message_done_ = true;
+            beast::flat_buffer buffer_;
+            beast::flat_buffer read_buffer_;
+            std::deque<std::pair<std::string, bool>> inbox_;
+            std::deque<std::tuple<std::uint64_t, frame_type, std::string>> unacked_;
+            std::deque<outgoing> queue_;
+            std::string writing_;
+            bool writing_continues_ = false;
+            bool write_in_progress_ = false;
+            bool close_requested_ = false;
+            bool closing_ = false;
+            bool dropped_ = false;
+
+        protected:
+            std::shared_ptr<FailSync> fail_sync;
+            websocket::stream<NextLayer> ws_;
+
+            template<class... Args>
+            explicit connection(std::shared_ptr<FailSync> fs, Args&&... args)
+                : fail_sync(std::move(fs))
+                , ws_(std::forward<Args>(args)...)
+            {
+                ws_.binary(true);
+            }
+
+            virtual ~connection() = default;
+
+            // Picks up a conversation from a dropped connection, call before start
+            void restore(state&& st)
+            {
+                task_.restore(st.snapshot);
+                phase_ = st.ph;
+                after_write_ = st.after_write;
+                next_send_ = st.next_send;
+                received_ = st.received;
+                message_done_ = st.message_done;
+                close_requested_ = st.close_requested;
+                buffer_.commit(net::buffer_copy(buffer_.prepare(st.partial.size()), net::buffer(st.partial)));
+                inbox_ = std::move(st.inbox);
+                unacked_ = std::move(st.unacked);
+            }
+
+            // Call once the handshake is complete, peer_received is the last frame the peer says it has
+            void start(std::uint64_t peer_received)
+            {
+                do_read();
+
+                if (phase_ == state::phase::starting && !close_requested_)
+                    return process_message(0);
+
+                // send again whatever the peer has not received
+                trim(peer_received);
+                for (auto const& frame : unacked_)
+                    queue_.push_back({std::get<1>(frame), std::get<0>(frame), std::get<2>(frame), false});
+
+                // the task had already finished, the connection closes once those frames are written
+                if (close_requested_)
+                    return close();
+
+                // the task carries on once its last frame has been written, if the peer already has it
+                // the write completed but the connection dropped before we heard about it
+                bool carry_on = false;
+                if (phase_ == state::phase::writing)
+                {
+                    if (!queue_.empty() && queue_.back().seq == next_send_ - 1)
+                        queue_.back().continues = true;
+                    else
+                        carry_on = true;
+                }
+
+                do_write();
+
+                if (carry_on)
+                    continue_after_write();
+                else
+                    drain();
+            }
+
+            std::uint64_t received() const { return received_; }
+
+            // Called once when the connection drops with what is needed to resume the conversation
+            virtual void on_dropped(state&& st, beast::error_code ec, char const* what) = 0;
+
+            // Treat the connection as dropped, e.g. when the network is known to have gone
+            void drop(beast::error_code ec, char const* what)
+            {
+                if (dropped_ || closing_)
+                    return;
+                dropped_ = true;
+
+                // any outstanding operation completes with an error that is then ignored
+                beast::error_code ignored;
+                beast::get_lowest_layer(ws_).socket().close(ignored);
+
+                on_dropped(capture(), ec, what);
+            }
+
+            template<class err_code> void fail(err_code ec, char const* what) { (*fail_sync)(ec, what); }
+
+        private:
+            state capture() const
+            {
+                state st;
+                st.snapshot = task_.snapshot();
+                st.ph = phase_;
+                st.after_write = after_write_;
+                st.next_send = next_send_;
+                st.received = received_;
+                st.message_done = message_done_;
+                st.close_requested = close_requested_;
+                st.partial = beast::buffers_to_string(buffer_.data());
+                st.inbox = inbox_;
+                st.unacked = unacked_;
+                return st;
+            }
+
+            void process_message(size_t bytes)
+            {
+                callback_return ret;
+                try
+                {
+                    ret = task_.callback(buffer_, bytes, message_done_);
+                }
+                catch (std::logic_error& ex)
+                {
+                    fail(make_error_code(errc::unrecognised_state), ex.what());
+                    return close();
+                }
+                catch (std::exception& ex)
+                {
+                    fail(make_error_code(errc::unexpected_exception), ex.what());
+                    return close();
+                }
+
+                buffer_.consume(buffer_.size());
+
+                switch (std::get<0>(ret))
+                {
+                case callback_result::read:
+                    phase_ = state::phase::reading_message;
+                    return drain();
+                case callback_result::need_more_reading:
+                    phase_ = state::phase::reading_blob;
+                    return drain();
+                case callback_result::need_more_writing:
+                    return send(frame_type::data, std::get<1>(ret), std::get<0>(ret));
+                case callback_result::write_complete:
+                case callback_result::write_complete_async_read:
+                    return send(frame_type::data_end, std::get<1>(ret), std::get<0>(ret));
+                case callback_result::close:
+                    return close();
+                default:
+                    fail(make_error_code(errc::unrecognised_state), "unexpected switch state");
+                    return close();
+                }
+            }
+
+            void continue_after_write()
+            {
+                switch (after_write_)
+                {
+                case callback_result::need_more_writing:
+                    return process_message(0);
+                case callback_result::write_complete:
+                    phase_ = state::phase::reading_message;
+                    return drain();
+                case callback_result::write_complete_async_read:
+                    phase_ = state::phase::reading_blob;
+                    return drain();
+                default:
+                    return;
+                }
+            }
+
+            // Hands the frames that have arrived to the task while it is waiting for them
+            void drain()
+            {
+                while (!inbox_.empty()
+                       && (phase_ == state::phase::reading_message || phase_ == state::phase::reading_blob))
+                {
+                    auto frame = std::move(inbox_.front());
+                    inbox_.pop_front();
+
+                    auto size = frame.first.size();
+                    buffer_.commit(net::buffer_copy(buffer_.prepare(size), net::buffer(frame.first)));
+                    message_done_ = frame.second;
+
+                    // a full read waits for the end of the message
+                    if (phase_ == state::phase::reading_message && !message_done_)
+                        continue;
+
+                    return process_message(buffer_.size());
+                }
+            }
+
+            void send(frame_type type, std::string const& payload, callback_result after_write)
+            {
+                phase_ = state::phase::writing;
+                after_write_ = after_write;
+
+                auto seq = next_send_++;
+                unacked_.emplace_back(seq, type, payload);
+                queue_.push_back({type, seq, payload, true});
+                do_write();
+            }
+
+            void close()
+            {
+                close_requested_ = true;
+                do_write();
+            }
+
+            // the peer has everything up to and including seq
+            void trim(std::uint64_t seq)
+            {
+                while (!unacked_.empty() && std::get<0>(unacked_.front()) <= seq)
+                    unacked_.pop_front();
+            }
+
+            void do_write()
+            {
+                if (write_in_progress_ || closing_ || dropped_)
+                    return;
+
+                if (queue_.empty())
+                {
+                    if (close_requested_)
+                    {
+                        closing_ = true;
+                        ws_.async_close(websocket::close_code::normal,
+                                        beast::bind_front_handler(&connection::on_close,
+                                                                  connection::shared_from_this()));
+                    }
+                    return;
+                }
+
+                auto frame = std::move(queue_.front());
+                queue_.pop_front();
+
+                // every frame acknowledges what we have received so far
+                writing_ = encode_frame(frame.type, frame.seq, received_, frame.payload);
+                writing_continues_ = frame.continues;
+                since_ack_ = 0;
+
+                write_in_progress_ = true;
+                ws_.async_write(net::buffer(writing_),
+                                beast::bind_front_handler(&connection::on_write, connection::shared_from_this()));
+            }
+
+            void on_write(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                write_in_progress_ = false;
+
+                if (dropped_)
+                    return;
+
+                if (ec)
+                    return drop(ec, "write");
+
+                if (writing_continues_)
+                    continue_after_write();
+
+                do_write();
+            }
+
+            void do_read()
+            {
+                ws_.async_read(read_buffer_,
+                               beast::bind_front_handler(&connection::on_read, connection::shared_from_this()));
+            }
+
+            void on_read(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                // This indicates that the connection was closed, a read that is
+                // pending while we close the connection ourselves gets cancelled
+                if (dropped_ || ec == websocket::error::closed
+                    || (closing_ && ec == net::error::operation_aborted))
+                    return;
+
+                if (ec)
+                    return drop(ec, "read");
+
+                frame_type type = frame_type::data;
+                std::uint64_t seq = 0;
+                std::uint64_t ack = 0;
+                auto data = read_buffer_.data();
+                if (!decode_header(data, type, seq, ack))
+                {
+                    fail(make_error_code(errc::invalid_frame), "read");
+                    return drop({}, "read");
+                }
+
+                std::string payload(static_cast<char const*>(data.data()) + header_size, data.size() - header_size);
+                read_buffer_.consume(read_buffer_.size());
+
+                trim(ack);
+
+                // frames we already had before the connection dropped are sent again
+                if (type != frame_type::ack && seq > received_)
+                {
+                    if (seq != received_ + 1)
+                    {
+                        fail(make_error_code(errc::invalid_frame), "sequence");
+                        return drop({}, "sequence");
+                    }
+
+                    received_ = seq;
+                    if (++since_ack_ >= ack_interval)
+                    {
+                        queue_.push_back({frame_type::ack, 0, std::string(), false});
+                        do_write();
+                    }
+
+                    inbox_.emplace_back(std::move(payload), type == frame_type::data_end);
+                    drain();
+                }
+
+                if (!dropped_)
+                    do_read();
+            }
+
+            void on_close(beast::error_code ec)
+            {
+                if (ec)
+                    return fail(ec, "close");
+            }
+        };
+    } // namespace resume
+} // namespace beast_machine
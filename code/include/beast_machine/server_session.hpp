@@ -1,14 +1,28 @@
 #pragma once 
 
 #include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <filesystem>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include "session.hpp"
+#include "admission.hpp"
+#include "io_backend.hpp"
+#include "multiplex.hpp"
+#include "resumable.hpp"
 
 namespace beast_machine
 {
@@ -20,38 +34,113 @@ namespace beast_machine
         namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
         namespace net = boost::asio;            // from <boost/asio.hpp>
         using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+        using local = net::local::stream_protocol; // from <boost/asio/local/stream_protocol.hpp>
+
+        using http_request = http::request<http::string_body>;
+        using http_response = http::response<http::string_body>;
+
+        // Plain http requests are answered by looking up their target in a route table
+        using route_handler = std::function<http_response(http_request const&)>;
+        using route_table = std::map<std::string, route_handler>;
+
+        // Counters shared between a listener and the connections it has accepted
+        struct listener_stats
+        {
+            std::atomic<std::uint64_t> connections_accepted {0};
+            std::atomic<std::uint64_t> http_requests {0};
+            std::atomic<std::uint64_t> websocket_upgrades {0};
+            std::atomic<std::uint64_t> sessions_resumed {0};
+            std::atomic<std::uint64_t> sessions_shed {0};
+            std::atomic<std::int64_t> active_sessions {0};
+            std::atomic<std::int64_t> handshakes_in_progress {0};
+            std::atomic<std::int64_t> loop_latency_us {0};
+            std::atomic<bool> ready {true};
+            std::atomic<bool> overloaded {false};
+        };
+
+        // Helper for route handlers, the http session fills in the version, keep alive and content length
+        inline http_response make_response(http::status status, std::string body,
+                                           char const* content_type = "text/plain")
+        {
+            http_response res {status, 11};
+            res.set(http::field::content_type, content_type);
+            res.body() = std::move(body);
+            return res;
+        }
+
+        // Gets a websocket stream ready to accept the handshake, extra_fields go into the handshake response
+        template<class Stream> void prepare_handshake(Stream& ws, http::fields extra_fields = {})
+        {
+            // the http timeout no longer applies, the websocket stream has its own timeout system
+            beast::get_lowest_layer(ws).expires_never();
+
+            // Set suggested timeout settings for the websocket
+            ws.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+
+            // Set a decorator to change the Server of the handshake
+            ws.set_option(websocket::stream_base::decorator([extra_fields](websocket::response_type& res) {
+                res.set(http::field::server, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-server-async");
+                for (auto const& field : extra_fields)
+                    res.set(field.name_string(), field.value());
+            }));
+        }
 
         //------------------------------------------------------------------------------
 
         // Echoes back all received WebSocket messages
-        template<class T, class FailSync>
-        class session : public std::enable_shared_from_this<session<T, FailSync>>, public T
+        // Protocol is either tcp or local for unix domain sockets
+        template<class T, class FailSync, class Protocol = tcp>
+        class session : public std::enable_shared_from_this<session<T, FailSync, Protocol>>, public T
         {
-            websocket::stream<beast::tcp_stream> ws_;
+            websocket::stream<beast::basic_stream<Protocol>> ws_;
             beast::flat_buffer buffer_;
+            std::string write_buffer_;
             std::shared_ptr<FailSync> fail_sync;
+            std::shared_ptr<listener_stats> stats_;
 
         public:
             // Take ownership of the socket
-            explicit session(tcp::socket&& socket, std::shared_ptr<FailSync>& fs)
+            explicit session(typename Protocol::socket&& socket, std::shared_ptr<FailSync>& fs)
                 : ws_(std::move(socket))
                 , fail_sync(fs)
             {
             }
 
+            // Take ownership of a stream whose upgrade request has already been read
+            session(beast::basic_stream<Protocol>&& stream, std::shared_ptr<FailSync>& fs,
+                    std::shared_ptr<listener_stats> stats)
+                : ws_(std::move(stream))
+                , fail_sync(fs)
+                , stats_(std::move(stats))
+            {
+                if (stats_)
+                    ++stats_->active_sessions;
+            }
+
+            ~session()
+            {
+                if (stats_)
+                    --stats_->active_sessions;
+            }
+
             // Start the asynchronous operation
             void run()
             {
-                // Set suggested timeout settings for the websocket
-                ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+                prepare_handshake(ws_);
 
-                // Set a decorator to change the Server of the handshake
-                ws_.set_option(websocket::stream_base::decorator([](websocket::response_type& res) {
-                    res.set(http::field::server, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-server-async");
-                }));
+                // Accept the websocket handshake
+                ws_.async_accept(beast::bind_front_handler(&session::on_accept,
+                                                           session<T, FailSync, Protocol>::shared_from_this()));
+            }
+
+            // Start the asynchronous operation with an upgrade request that has already been read
+            void run(http_request const& req)
+            {
+                prepare_handshake(ws_);
 
                 // Accept the websocket handshake
-                ws_.async_accept(beast::bind_front_handler(&session::on_accept, session<T, FailSync>::shared_from_this()));
+                ws_.async_accept(req, beast::bind_front_handler(&session::on_accept,
+                                                                session<T, FailSync, Protocol>::shared_from_this()));
             }
 
             void process_message(size_t bytes)
@@ -60,6 +149,9 @@ namespace beast_machine
 
                 buffer_.consume(buffer_.size());
 
+                // the message has to outlive the write, which may not complete before the call returns
+                write_buffer_ = std::move(std::get<1>(ret));
+
                 try
                 {
                     switch (std::get<0>(ret))
@@ -74,21 +166,24 @@ namespace beast_machine
                         return;
                     case callback_result::need_more_writing:
                         // Send the message
-                        ws_.async_write_some(false, net::buffer(std::get<1>(ret)),
-                                            beast::bind_front_handler(&session::on_write_contunue,
-                                                                    session<T, FailSync>::shared_from_this()));
+                        ws_.async_write_some(
+                            false, net::buffer(write_buffer_),
+                            beast::bind_front_handler(&session::on_write_contunue,
+                                                      session<T, FailSync, Protocol>::shared_from_this()));
                         return;
                     case callback_result::write_complete:
                         // Send the message
                         ws_.async_write_some(
-                            true, net::buffer(std::get<1>(ret)),
-                            beast::bind_front_handler(&session::on_write, session<T, FailSync>::shared_from_this()));
+                            true, net::buffer(write_buffer_),
+                            beast::bind_front_handler(&session::on_write,
+                                                      session<T, FailSync, Protocol>::shared_from_this()));
                         return;
                     case callback_result::write_complete_async_read:
                         // Send the message
-                        ws_.async_write_some(true, net::buffer(std::get<1>(ret)),
-                                            beast::bind_front_handler(&session::on_write_complete_async_read,
-                                                                    session<T, FailSync>::shared_from_this()));
+                        ws_.async_write_some(
+                            true, net::buffer(write_buffer_),
+                            beast::bind_front_handler(&session::on_write_complete_async_read,
+                                                      session<T, FailSync, Protocol>::shared_from_this()));
                         return;
                     case callback_result::close:
                         break;
@@ -108,7 +203,8 @@ namespace beast_machine
 
                 // Close the WebSocket connection
                 ws_.async_close(websocket::close_code::normal,
-                                beast::bind_front_handler(&session::on_close, session<T, FailSync>::shared_from_this()));
+                                beast::bind_front_handler(&session::on_close,
+                                                          session<T, FailSync, Protocol>::shared_from_this()));
             }
 
             void on_accept(beast::error_code ec)
@@ -123,15 +219,18 @@ namespace beast_machine
             void do_read()
             {
                 // Read a message into our buffer
-                ws_.async_read(buffer_,
-                            beast::bind_front_handler(&session::on_read, session<T, FailSync>::shared_from_this()));
+                ws_.async_read(buffer_, beast::bind_front_handler(&session::on_read,
+                                                                  session<T, FailSync, Protocol>::shared_from_this()));
             }
 
             void do_read_blob()
             {
+                buffer_.reserve(blob_read_size);
+
                 // Read a message into our buffer
                 ws_.async_read_some(buffer_, buffer_.capacity(),
-                                    beast::bind_front_handler(&session::on_read, session<T, FailSync>::shared_from_this()));
+                                    beast::bind_front_handler(&session::on_read,
+                                                              session<T, FailSync, Protocol>::shared_from_this()));
             }
 
             void on_read(beast::error_code ec, std::size_t bytes_transferred)
@@ -192,21 +291,485 @@ namespace beast_machine
 
         //------------------------------------------------------------------------------
 
+        // Runs a T for every channel a client opens over a multiplexed connection
+        template<class T, class FailSync, class Protocol = tcp>
+        class mux_session : public mux::connection<T, FailSync, beast::basic_stream<Protocol>>
+        {
+            using base = mux::connection<T, FailSync, beast::basic_stream<Protocol>>;
+
+            std::shared_ptr<listener_stats> stats_;
+
+        public:
+            mux_session(beast::basic_stream<Protocol>&& stream, std::shared_ptr<FailSync>& fs,
+                        std::shared_ptr<listener_stats> stats, std::size_t max_channels)
+                : base(fs, false, std::move(stream))
+                , stats_(std::move(stats))
+            {
+                this->set_max_channels(max_channels);
+                if (stats_)
+                    ++stats_->active_sessions;
+            }
+
+            ~mux_session()
+            {
+                if (stats_)
+                    --stats_->active_sessions;
+            }
+
+            // Start the asynchronous operation with an upgrade request that has already been read
+            void run(http_request const& req)
+            {
+                // Agree to the multiplexing protocol in the handshake response
+                http::fields fields;
+                fields.set(http::field::sec_websocket_protocol, mux::subprotocol);
+                prepare_handshake(this->ws_, std::move(fields));
+
+                // Accept the websocket handshake
+                this->ws_.async_accept(req, beast::bind_front_handler(&mux_session::on_accept, self()));
+            }
+
+        private:
+            std::shared_ptr<mux_session> self()
+            {
+                return std::static_pointer_cast<mux_session>(this->shared_from_this());
+            }
+
+            void on_accept(beast::error_code ec)
+            {
+                if (ec)
+                    return this->fail(ec, "accept");
+
+                this->start();
+            }
+        };
+
+        //------------------------------------------------------------------------------
+
+        // Runs a T whose conversation can be picked up again by the client after the connection drops,
+        // until then its state is held in the store
+        template<class T, class FailSync, class Protocol = tcp>
+        class resumable_session : public resume::connection<T, FailSync, beast::basic_stream<Protocol>>
+        {
+            using base = resume::connection<T, FailSync, beast::basic_stream<Protocol>>;
+
+            std::shared_ptr<listener_stats> stats_;
+            std::shared_ptr<resume::store> store_;
+            resume::resume_point peer_;
+            std::uint64_t live_id_ = 0;
+
+        public:
+            // peer is the resume point sent by the client, with an empty token for a new conversation
+            resumable_session(beast::basic_stream<Protocol>&& stream, std::shared_ptr<FailSync>& fs,
+                              std::shared_ptr<listener_stats> stats, std::shared_ptr<resume::store> store,
+                              resume::resume_point peer, std::optional<resume::state> st)
+                : base(fs, std::move(stream))
+                , stats_(std::move(stats))
+                , store_(std::move(store))
+                , peer_(std::move(peer))
+            {
+                if (peer_.token.empty())
+                    peer_.token = store_->make_token();
+
+                if (st)
+                    this->restore(std::move(*st));
+
+                if (stats_)
+                    ++stats_->active_sessions;
+            }
+
+            ~resumable_session()
+            {
+                store_->detach(peer_.token, live_id_);
+
+                if (stats_)
+                    --stats_->active_sessions;
+            }
+
+            // Start the asynchronous operation with an upgrade request that has already been read
+            void run(http_request const& req)
+            {
+                // Tell the client how to resume and how much of the conversation we have
+                http::fields fields;
+                fields.set(http::field::sec_websocket_protocol, resume::subprotocol);
+                fields.set(resume::header, resume::to_string({peer_.token, this->received()}));
+                prepare_handshake(this->ws_, std::move(fields));
+
+                // A client that comes back before we notice this connection drop takes the conversation over
+                live_id_ = store_->attach(peer_.token, [weak = std::weak_ptr<resumable_session>(self())](auto done) {
+                    auto s = weak.lock();
+                    if (!s)
+                        return done();
+
+                    net::post(s->ws_.get_executor(), [s, done] {
+                        s->drop({}, "taken over");
+                        done();
+                    });
+                });
+
+                // Accept the websocket handshake
+                this->ws_.async_accept(req, beast::bind_front_handler(&resumable_session::on_accept, self()));
+            }
+
+        protected:
+            void on_dropped(resume::state&& st, beast::error_code ec, char const* what) override
+            {
+                boost::ignore_unused(ec, what);
+
+                store_->detach(peer_.token, live_id_);
+                store_->put(peer_.token, std::move(st));
+            }
+
+        private:
+            std::shared_ptr<resumable_session> self()
+            {
+                return std::static_pointer_cast<resumable_session>(this->shared_from_this());
+            }
+
+            void on_accept(beast::error_code ec)
+            {
+                if (ec)
+                    return this->fail(ec, "accept");
+
+                this->start(peer_.received);
+            }
+        };
+
+        //------------------------------------------------------------------------------
+
+        // Completes a websocket handshake only to close the connection straight away with
+        // close code 1013 (try again later), used to turn new plain sessions away under load
+        template<class FailSync, class Protocol = tcp>
+        class rejected_session : public std::enable_shared_from_this<rejected_session<FailSync, Protocol>>
+        {
+            websocket::stream<beast::basic_stream<Protocol>> ws_;
+            std::shared_ptr<FailSync> fail_sync;
+
+        public:
+            rejected_session(beast::basic_stream<Protocol>&& stream, std::shared_ptr<FailSync>& fs)
+                : ws_(std::move(stream))
+                , fail_sync(fs)
+            {
+            }
+
+            void run(http_request const& req)
+            {
+                // agree to the first subprotocol offered so that the client reads the close code rather than
+                // failing the handshake, the response may only name one of them
+                http::fields fields;
+                for (auto const& offered : http::token_list {req[http::field::sec_websocket_protocol]})
+                {
+                    fields.set(http::field::sec_websocket_protocol, offered);
+                    break;
+                }
+                prepare_handshake(ws_, std::move(fields));
+
+                ws_.async_accept(
+                    req, beast::bind_front_handler(&rejected_session::on_accept,
+                                                   rejected_session<FailSync, Protocol>::shared_from_this()));
+            }
+
+        private:
+            void on_accept(beast::error_code ec)
+            {
+                if (ec)
+                    return fail(ec, "accept");
+
+                ws_.async_close(websocket::close_reason(websocket::close_code::try_again_later, "overloaded"),
+                                beast::bind_front_handler(&rejected_session::on_close,
+                                                          rejected_session<FailSync, Protocol>::shared_from_this()));
+            }
+
+            void on_close(beast::error_code ec)
+            {
+                if (ec)
+                    return fail(ec, "close");
+            }
+
+            template<class err_code> void fail(err_code ec, char const* what) { (*fail_sync)(ec, what); }
+        };
+
+        //------------------------------------------------------------------------------
+
+        // Reads the first http request of a connection, upgrade requests are handed over to a websocket session
+        // and anything else is answered from the route table without creating one
+        template<class T, class FailSync, class Protocol = tcp>
+        class http_session : public std::enable_shared_from_this<http_session<T, FailSync, Protocol>>
+        {
+            beast::basic_stream<Protocol> stream_;
+            beast::flat_buffer buffer_;
+            std::optional<http::request_parser<http::string_body>> parser_;
+            http_response res_;
+            std::shared_ptr<route_table const> routes_;
+            std::shared_ptr<listener_stats> stats_;
+            std::shared_ptr<resume::store> store_;
+            std::shared_ptr<admission_policy const> policy_;
+            std::function<void()> handshake_done_;
+            std::shared_ptr<FailSync> fail_sync;
+            bool in_handshake_ = true;
+            bool evicted_ = false;
+
+        public:
+            // handshake_done is called once the first request has been read or the connection has gone
+            http_session(typename Protocol::socket&& socket, std::shared_ptr<route_table const> routes,
+                         std::shared_ptr<listener_stats> stats, std::shared_ptr<resume::store> store,
+                         std::shared_ptr<admission_policy const> policy, std::function<void()> handshake_done,
+                         std::shared_ptr<FailSync>& fs)
+                : stream_(std::move(socket))
+                , routes_(std::move(routes))
+                , stats_(std::move(stats))
+                , store_(std::move(store))
+                , policy_(std::move(policy))
+                , handshake_done_(std::move(handshake_done))
+                , fail_sync(fs)
+            {
+                ++stats_->handshakes_in_progress;
+            }
+
+            ~http_session() { end_handshake(); }
+
+            void run() { do_read(); }
+
+        private:
+            void do_read()
+            {
+                // a fresh parser for each request
+                parser_.emplace();
+
+                // health checks and upgrade requests are small
+                parser_->body_limit(10000);
+
+                stream_.expires_after(std::chrono::seconds(30));
+
+                http::async_read(stream_, buffer_, *parser_,
+                                 beast::bind_front_handler(&http_session::on_read,
+                                                           http_session<T, FailSync, Protocol>::shared_from_this()));
+            }
+
+            // Only the first request counts as a handshake, a keep alive connection waiting for
+            // its next request does not hold up new connections
+            void end_handshake()
+            {
+                if (!in_handshake_)
+                    return;
+
+                in_handshake_ = false;
+                --stats_->handshakes_in_progress;
+                if (handshake_done_)
+                    handshake_done_();
+            }
+
+            void on_read(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                end_handshake();
+
+                // This means they closed the connection
+                if (ec == http::error::end_of_stream)
+                    return do_close();
+
+                if (ec)
+                    return fail(ec, "http read");
+
+                if (websocket::is_upgrade(parser_->get()))
+                {
+                    ++stats_->websocket_upgrades;
+
+                    if (should_shed(parser_->get()))
+                    {
+                        ++stats_->sessions_shed;
+
+                        // the multiplexing and resumable clients need more from the handshake response than a
+                        // close code would leave them, they are told to come back later before the upgrade
+                        if (mux::is_requested(parser_->get()) || resume::is_requested(parser_->get()))
+                        {
+                            auto res = make_response(http::status::service_unavailable, "overloaded");
+                            res.set(http::field::retry_after, "1");
+                            return send_response(std::move(res), parser_->get());
+                        }
+
+                        std::make_shared<rejected_session<FailSync, Protocol>>(std::move(stream_), fail_sync)
+                            ->run(parser_->release());
+                        return;
+                    }
+
+                    if constexpr (resume::is_resumable_v<T>)
+                    {
+                        if (resume::is_requested(parser_->get()))
+                            return start_resumable();
+                    }
+
+                    // Create the websocket session and hand it the request we have already parsed
+                    if (mux::is_requested(parser_->get()))
+                    {
+                        std::make_shared<mux_session<T, FailSync, Protocol>>(std::move(stream_), fail_sync, stats_,
+                                                                             policy_->max_channels)
+                            ->run(parser_->release());
+                    }
+                    else
+                    {
+                        std::make_shared<session<T, FailSync, Protocol>>(std::move(stream_), fail_sync, stats_)
+                            ->run(parser_->release());
+                    }
+                    return;
+                }
+
+                auto req = parser_->release();
+                send_response(handle_request(req), req);
+            }
+
+            // The sessions already running come first: new handshakes are turned away at the session limit
+            // or while the server is overloaded, a conversation being resumed only at the session limit
+            bool should_shed(http_request const& req) const
+            {
+                if (policy_->max_sessions != 0
+                    && stats_->active_sessions >= static_cast<std::int64_t>(policy_->max_sessions))
+                    return true;
+
+                bool resuming = resume::is_requested(req) && !req[resume::header].empty();
+                return stats_->overloaded && !resuming;
+            }
+
+            void start_resumable()
+            {
+                resume::resume_point peer;
+                std::optional<resume::state> st;
+
+                auto value = parser_->get()[resume::header];
+                if (!value.empty())
+                {
+                    auto point = resume::parse(value);
+                    if (point)
+                        st = store_->take(point->token);
+
+                    // the client came back before we noticed its old connection drop, drop that connection
+                    // and look again once its state is in the store
+                    if (point && !st && !evicted_)
+                    {
+                        evicted_ = true;
+                        auto resume_here = [self = http_session<T, FailSync, Protocol>::shared_from_this()] {
+                            net::post(self->stream_.get_executor(), [self] { self->start_resumable(); });
+                        };
+                        if (store_->evict(point->token, resume_here))
+                            return;
+                    }
+
+                    // the conversation has expired or has ended
+                    if (!st)
+                        return send_response(make_response(http::status::not_found, "unknown session"), parser_->get());
+
+                    peer = *point;
+                    ++stats_->sessions_resumed;
+                }
+
+                std::make_shared<resumable_session<T, FailSync, Protocol>>(std::move(stream_), fail_sync, stats_,
+                                                                           store_, std::move(peer), std::move(st))
+                    ->run(parser_->release());
+            }
+
+            http_response handle_request(http_request const& req)
+            {
+                ++stats_->http_requests;
+
+                http_response res;
+                if (req.method() != http::verb::get)
+                {
+                    res = make_response(http::status::method_not_allowed, "method not allowed");
+                }
+                else
+                {
+                    // ignore any query string when looking up the route
+                    auto target = req.target();
+                    target = target.substr(0, target.find('?'));
+
+                    auto it = routes_->find(std::string(target));
+                    if (it == routes_->end())
+                        res = make_response(http::status::not_found, "not found");
+                    else
+                        res = it->second(req);
+                }
+
+                return res;
+            }
+
+            void send_response(http_response&& res, http_request const& req)
+            {
+                res_ = std::move(res);
+                res_.version(req.version());
+                res_.keep_alive(req.keep_alive());
+                res_.set(http::field::server, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-server-async");
+                res_.prepare_payload();
+
+                http::async_write(stream_, res_,
+                                  beast::bind_front_handler(&http_session::on_write,
+                                                            http_session<T, FailSync, Protocol>::shared_from_this()));
+            }
+
+            void on_write(beast::error_code ec, std::size_t bytes_transferred)
+            {
+                boost::ignore_unused(bytes_transferred);
+
+                if (ec)
+                    return fail(ec, "http write");
+
+                // This means we should close the connection, usually because
+                // the response indicated the "Connection: close" semantic.
+                if (res_.need_eof())
+                    return do_close();
+
+                do_read();
+            }
+
+            void do_close()
+            {
+                // Send a TCP shutdown
+                beast::error_code ec;
+                stream_.socket().shutdown(net::socket_base::shutdown_send, ec);
+
+                // At this point the connection is closed gracefully
+            }
+
+            template<class err_code> void fail(err_code ec, char const* what) { (*fail_sync)(ec, what); }
+        };
+
+        //------------------------------------------------------------------------------
+
         // Accepts incoming connections and launches the sessions
-        template<class T, class FailSync> class listener : public std::enable_shared_from_this<listener<T, FailSync>>
+        template<class T, class FailSync, class Protocol = tcp>
+        class listener : public std::enable_shared_from_this<listener<T, FailSync, Protocol>>
         {
             net::io_context& ioc_;
-            tcp::acceptor acceptor_;
+            typename Protocol::acceptor acceptor_;
             bool single_request_;
             std::shared_ptr<FailSync> fail_sync;
+            std::shared_ptr<listener_stats> stats_;
+            std::shared_ptr<route_table> routes_;
+            std::shared_ptr<resume::store> resume_store_;
+            std::shared_ptr<admission_policy const> policy_;
+            std::optional<token_bucket> accept_bucket_;
+            net::steady_timer accept_timer_;
+            net::steady_timer probe_timer_;
+            std::chrono::steady_clock::time_point probe_expected_;
+            std::chrono::steady_clock::duration loop_latency_ {};
+            bool accepting_ = true;
+            bool waiting_for_handshake_ = false;
 
         public:
-            listener(net::io_context& ioc, tcp::endpoint endpoint, bool single_request, std::shared_ptr<FailSync>& fs)
+            listener(net::io_context& ioc, typename Protocol::endpoint endpoint, bool single_request,
+                     std::shared_ptr<FailSync>& fs)
                 : ioc_(ioc)
-                , acceptor_(ioc)
+                , acceptor_(net::make_strand(ioc))
                 , single_request_(single_request)
                 , fail_sync(fs)
+                , stats_(std::make_shared<listener_stats>())
+                , routes_(std::make_shared<route_table>())
+                , resume_store_(std::make_shared<resume::store>(std::chrono::seconds(60)))
+                , policy_(std::make_shared<admission_policy>())
+                , accept_timer_(acceptor_.get_executor())
+                , probe_timer_(acceptor_.get_executor())
             {
+                add_default_routes();
+
                 beast::error_code ec;
 
                 // Open the acceptor
@@ -217,12 +780,31 @@ namespace beast_machine
                     return;
                 }
 
-                // Allow address reuse
-                acceptor_.set_option(net::socket_base::reuse_address(true), ec);
-                if (ec)
+                if constexpr (std::is_same_v<Protocol, local>)
                 {
-                    fail(ec, "set_option");
-                    return;
+                    // A socket file left behind by a previous run would make the bind fail. Nobody answers on
+                    // a stale one, a socket another server is listening on and anything else at the path are
+                    // left for the bind to fail on. Abstract socket names start with a null and have no file
+                    auto path = endpoint.path();
+                    std::error_code fs_ec;
+                    if (!path.empty() && path[0] != '\0' && std::filesystem::is_socket(path, fs_ec))
+                    {
+                        local::socket probe(ioc);
+                        beast::error_code probe_ec;
+                        probe.connect(endpoint, probe_ec);
+                        if (probe_ec == net::error::connection_refused)
+                            std::filesystem::remove(path, fs_ec);
+                    }
+                }
+                else
+                {
+                    // Allow address reuse
+                    acceptor_.set_option(net::socket_base::reuse_address(true), ec);
+                    if (ec)
+                    {
+                        fail(ec, "set_option");
+                        return;
+                    }
                 }
 
                 // Bind to the server address
@@ -242,19 +824,105 @@ namespace beast_machine
                 }
             }
 
+            // Routes must be added before calling run, existing targets are replaced
+            void add_route(std::string target, route_handler handler)
+            {
+                (*routes_)[std::move(target)] = std::move(handler);
+            }
+
+            // Controls the answer of the readiness route, e.g. while warming up or draining
+            void set_ready(bool ready) { stats_->ready = ready; }
+
+            listener_stats const& stats() const { return *stats_; }
+
+            // How long, and how many, dropped resumable conversations are kept for, call before run
+            void set_resume_retention(std::chrono::seconds retention, std::size_t capacity = 1000)
+            {
+                resume_store_ = std::make_shared<resume::store>(retention, capacity);
+            }
+
+            // Limits the connections and sessions taken on, call before run
+            void set_admission_policy(admission_policy policy)
+            {
+                if (policy.max_memory != 0 && !policy.memory_usage)
+                    policy.memory_usage = resident_memory;
+
+                accept_bucket_.reset();
+                if (policy.accept_rate > 0)
+                    accept_bucket_.emplace(policy.accept_rate, policy.accept_burst, std::chrono::steady_clock::now());
+
+                policy_ = std::make_shared<admission_policy>(std::move(policy));
+            }
+
             // Start accepting incoming connections
-            void run() { do_accept(); }
+            void run()
+            {
+                if (policy_->max_loop_latency.count() != 0 || policy_->max_memory != 0)
+                    do_probe();
+
+                do_accept();
+            }
 
         private:
+            void add_default_routes()
+            {
+                auto stats = stats_;
+
+                add_route("/health", [](http_request const&) { return make_response(http::status::ok, "ok"); });
+
+                add_route("/ready", [stats](http_request const&) {
+                    if (stats->ready && !stats->overloaded)
+                        return make_response(http::status::ok, "ready");
+                    return make_response(http::status::service_unavailable, "not ready");
+                });
+
+                add_route("/stats", [stats](http_request const&) {
+                    std::stringstream ss;
+                    ss << "{\"connections_accepted\":" << stats->connections_accepted
+                       << ",\"http_requests\":" << stats->http_requests
+                       << ",\"websocket_upgrades\":" << stats->websocket_upgrades
+                       << ",\"sessions_resumed\":" << stats->sessions_resumed
+                       << ",\"sessions_shed\":" << stats->sessions_shed
+                       << ",\"active_sessions\":" << stats->active_sessions
+                       << ",\"handshakes_in_progress\":" << stats->handshakes_in_progress
+                       << ",\"loop_latency_us\":" << stats->loop_latency_us
+                       << ",\"overloaded\":" << (stats->overloaded ? "true" : "false")
+                       << ",\"io_backend\":\"" << to_string(current_io_backend()) << "\"}";
+                    return make_response(http::status::ok, ss.str(), "application/json");
+                });
+            }
+
             void do_accept()
             {
+                // New connections wait in the listen backlog while we are at the handshake limit,
+                // until a handshake is done, or have run out of accept tokens
+                if (policy_->max_handshakes != 0
+                    && stats_->handshakes_in_progress >= static_cast<std::int64_t>(policy_->max_handshakes))
+                {
+                    waiting_for_handshake_ = true;
+                    return;
+                }
+
+                auto delay = std::chrono::steady_clock::duration::zero();
+                if (accept_bucket_)
+                    delay = accept_bucket_->take(std::chrono::steady_clock::now());
+
+                if (delay != std::chrono::steady_clock::duration::zero())
+                {
+                    accept_timer_.expires_after(delay);
+                    accept_timer_.async_wait(beast::bind_front_handler(
+                        &listener::on_accept_delay, listener<T, FailSync, Protocol>::shared_from_this()));
+                    return;
+                }
+
                 // The new connection gets its own strand
                 acceptor_.async_accept(
                     net::make_strand(ioc_),
-                    beast::bind_front_handler(&listener::on_accept, listener<T, FailSync>::shared_from_this()));
+                    beast::bind_front_handler(&listener::on_accept,
+                                              listener<T, FailSync, Protocol>::shared_from_this()));
             }
 
-            void on_accept(beast::error_code ec, tcp::socket socket)
+            void on_accept(beast::error_code ec, typename Protocol::socket socket)
             {
                 if (ec)
                 {
@@ -262,8 +930,19 @@ namespace beast_machine
                 }
                 else
                 {
-                    // Create the session and run it
-                    std::make_shared<session<T, FailSync>>(std::move(socket), fail_sync)->run();
+                    ++stats_->connections_accepted;
+
+                    // Read the first request to find out whether this is a websocket upgrade or a plain http request
+                    auto handshake_done = [weak = this->weak_from_this(), executor = acceptor_.get_executor()] {
+                        net::post(executor, [weak] {
+                            if (auto self = weak.lock())
+                                self->on_handshake_done();
+                        });
+                    };
+                    std::make_shared<http_session<T, FailSync, Protocol>>(std::move(socket), routes_, stats_,
+                                                                         resume_store_, policy_, handshake_done,
+                                                                         fail_sync)
+                        ->run();
                 }
 
                 // Accept another connection
@@ -271,6 +950,56 @@ namespace beast_machine
                 {
                     do_accept();
                 }
+                else
+                {
+                    accepting_ = false;
+                    probe_timer_.cancel();
+                }
+            }
+
+            void on_accept_delay(beast::error_code ec)
+            {
+                if (ec)
+                    return;
+
+                do_accept();
+            }
+
+            void on_handshake_done()
+            {
+                if (!waiting_for_handshake_ || !accepting_)
+                    return;
+
+                waiting_for_handshake_ = false;
+                do_accept();
+            }
+
+            // Measures how late the event loop runs a timer, which is how long every session waits for its
+            // handlers to be run, and checks the memory in use
+            void do_probe()
+            {
+                probe_expected_ = std::chrono::steady_clock::now() + policy_->probe_interval;
+                probe_timer_.expires_at(probe_expected_);
+                probe_timer_.async_wait(beast::bind_front_handler(&listener::on_probe,
+                                                                  listener<T, FailSync, Protocol>::shared_from_this()));
+            }
+
+            void on_probe(beast::error_code ec)
+            {
+                if (ec || !accepting_)
+                    return;
+
+                // smooth out the odd slow handler
+                auto lag = std::chrono::steady_clock::now() - probe_expected_;
+                loop_latency_ = (loop_latency_ * 7 + lag) / 8;
+                stats_->loop_latency_us = std::chrono::duration_cast<std::chrono::microseconds>(loop_latency_).count();
+
+                bool overloaded = policy_->max_loop_latency.count() != 0 && loop_latency_ > policy_->max_loop_latency;
+                if (policy_->max_memory != 0)
+                    overloaded = overloaded || policy_->memory_usage() > policy_->max_memory;
+                stats_->overloaded = overloaded;
+
+                do_probe();
             }
             template<class err_code> void fail(err_code ec, char const* what) { (*fail_sync)(ec, what); }
         };
@@ -294,6 +1023,21 @@ namespace beast_machine
         case errc::unexpected_exception:
             return "unexpected exception";
 
+        case errc::invalid_frame:
+            return "invalid frame";
+
+        case errc::multiplex_not_supported:
+            return "multiplexing not supported by the server";
+
+        case errc::resume_not_supported:
+            return "resumable sessions not supported by the server";
+
+        case errc::channel_refused:
+            return "channel closed by the peer";
+
+        case errc::server_overloaded:
+            return "server overloaded, try again later";
+
         default:
             return "(unrecognized error)";
         }
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <system_error>
+#include <tuple>
 
 namespace beast_machine
 {
@@ -18,15 +22,42 @@ enum class callback_result
 
 using callback_return = std::tuple<callback_result, std::string>;
 
+// sessions reading a blob keep a read buffer of this size and reuse it for every read, so that
+// each read takes in as much as the socket has instead of the little the buffer grew to
+constexpr std::size_t blob_read_size = 64 * 1024;
+
 
 enum class errc
 {
   // no 0
   unrecognised_state = 1, 
   unexpected_exception, 
+  invalid_frame,
+  multiplex_not_supported,
+  resume_not_supported,
+  channel_refused,
+  server_overloaded,
 };
 
 std::error_code make_error_code(beast_machine::errc);
+
+namespace detail
+{
+  // big endian integers for the frame headers
+  inline void put_uint(std::string& out, std::uint64_t value, std::size_t bytes)
+  {
+    for (std::size_t i = bytes; i-- > 0;)
+      out.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+  }
+
+  inline std::uint64_t get_uint(unsigned char const* in, std::size_t bytes)
+  {
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; i++)
+      value = (value << 8) | in[i];
+    return value;
+  }
+}
 }
 
 namespace std
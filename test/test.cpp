@@ -1,13 +1,18 @@
 #define CATCH_CONFIG_MAIN
 #define CATCH_CONFIG_CONSOLE_WIDTH 300
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <thread>
 #include <iomanip>
 #include <iostream>
 #include <thread>
 #include <map>
 #include <memory>
+#include <future>
 #include <sstream>
 
 #include <catch2/catch.hpp>
@@ -27,6 +32,7 @@
 namespace beast = boost::beast;   // from <boost/beast.hpp>
 namespace net = boost::asio;      // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+using local = net::local::stream_protocol; // from <boost/asio/local/stream_protocol.hpp>
 
 namespace websocket_with_beast_server_combined
 {
@@ -63,9 +69,32 @@ namespace websocket_with_beast_server_combined
         bool _read_streamed_data = false;
 
     public:
+        // lets a test interrupt the conversation part way through
+        static inline int callback_count = 0;
+
+        // lets a test count the conversations
+        static inline int instance_count = 0;
+
         hello_world_task()
             : _state(initialise)
         {
+            instance_count++;
+        }
+
+        // makes the task resumable
+        std::string snapshot() const
+        {
+            std::stringstream ss;
+            ss << _state << " " << _stream_count << " " << _read_streamed_data;
+            return ss.str();
+        }
+
+        void restore(std::string const& snapshot)
+        {
+            int state = 0;
+            std::stringstream ss(snapshot);
+            ss >> state >> _stream_count >> _read_streamed_data;
+            _state = static_cast<client_state_state>(state);
         }
 
         // this makes the code easier to read when you have unit_test state too
@@ -75,6 +104,7 @@ namespace websocket_with_beast_server_combined
         beast_machine::callback_return callback(beast::flat_buffer& buffer, size_t& readable_bytes,
                                                 bool message_read_complete)
         {
+            callback_count++;
             std::cout << beast::make_printable(buffer.cdata()) << "\n";
             switch (_state)
             {
@@ -216,4 +246,828 @@ namespace websocket_with_beast_server_combined
         client_ioc.run();
         t.join();
     };
+    TEST_CASE("websocket with beast server over unix domain socket") // NOLINT
+    {
+        auto const path = (std::filesystem::temp_directory_path() / "beast_machine_test.sock").string();
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail, local>>(
+            server_ioc, local::endpoint {path}, true, f)
+            ->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        // the socket is already listening so no need to wait for the server thread
+        std::make_shared<beast_machine::client::session<hello_world_task<environment::client>, fail, local>>(client_ioc,
+                                                                                                               f)
+            ->run(local::endpoint {path}, "localhost", "/");
+
+        client_ioc.run();
+        t.join();
+
+        std::filesystem::remove(path);
+    };
+
+    // Remembers the last failure instead of failing the test
+    struct record_fail
+    {
+        std::string what;
+        std::error_code ec;
+        int count = 0;
+
+        void operator()(std::error_code e, char const* w)
+        {
+            what = w;
+            ec = e;
+            ++count;
+        }
+    };
+
+    // Waits a few seconds at most for something the server does on its own thread
+    template<class Predicate> bool eventually(Predicate predicate)
+    {
+        auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!predicate() && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return predicate();
+    }
+
+    TEST_CASE("unix domain socket listener leaves a file that is not a socket alone") // NOLINT
+    {
+        auto const path = (std::filesystem::temp_directory_path() / "beast_machine_test.file").string();
+        std::ofstream(path) << "not a socket";
+
+        auto f = std::make_shared<record_fail>();
+
+        net::io_context server_ioc {1};
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, record_fail, local>>(
+            server_ioc, local::endpoint {path}, true, f);
+
+        REQUIRE(f->what == "bind");                      // NOLINT
+        REQUIRE(std::filesystem::is_regular_file(path)); // NOLINT
+
+        std::filesystem::remove(path);
+    };
+
+    TEST_CASE("unix domain socket listener leaves the socket of a running server alone") // NOLINT
+    {
+        auto const path = (std::filesystem::temp_directory_path() / "beast_machine_live.sock").string();
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        // the second server checks whether the path is in use with a connection of its own
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail, local>>(
+            server_ioc, local::endpoint {path}, false, f)
+            ->run();
+
+        // a second server on the same path fails to bind rather than taking the path over
+        auto second_f = std::make_shared<record_fail>();
+        net::io_context second_ioc {1};
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, record_fail, local>>(
+            second_ioc, local::endpoint {path}, true, second_f);
+
+        REQUIRE(second_f->what == "bind"); // NOLINT
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        // the first server still takes new connections
+        net::io_context client_ioc;
+        std::make_shared<beast_machine::client::session<hello_world_task<environment::client>, fail, local>>(client_ioc,
+                                                                                                               f)
+            ->run(local::endpoint {path}, "localhost", "/");
+
+        client_ioc.run();
+
+        server_ioc.stop();
+        t.join();
+
+        std::filesystem::remove(path);
+    };
+
+    TEST_CASE("multiplexed conversations over one websocket connection") // NOLINT
+    {
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8082;
+        auto const channels = 10;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, true, f);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        // each channel streams more frames than the flow control window allows without credit
+        std::make_shared<beast_machine::client::mux_session<hello_world_task<environment::client>, fail>>(
+            client_ioc, f, channels)
+            ->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        client_ioc.run();
+        t.join();
+
+        REQUIRE(l->stats().connections_accepted == 1); // NOLINT
+        REQUIRE(l->stats().websocket_upgrades == 1);   // NOLINT
+        REQUIRE(l->stats().active_sessions == 0);      // NOLINT
+    };
+
+    TEST_CASE("multiplexed connection closes channels over the limit") // NOLINT
+    {
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8085;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, true, f);
+        beast_machine::server::admission_policy policy;
+        policy.max_channels = 2;
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        // all four channels are opened before the first two have finished
+        hello_world_task<environment::server>::instance_count = 0;
+        auto client_f = std::make_shared<record_fail>();
+        std::make_shared<beast_machine::client::mux_session<hello_world_task<environment::client>, record_fail>>(
+            client_ioc, client_f, 4)
+            ->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        client_ioc.run();
+        t.join();
+
+        REQUIRE(hello_world_task<environment::server>::instance_count == 2);            // NOLINT
+        REQUIRE(l->stats().active_sessions == 0);                                       // NOLINT
+        REQUIRE(client_f->count == 2);                                                  // NOLINT
+        REQUIRE(client_f->ec == make_error_code(beast_machine::errc::channel_refused)); // NOLINT
+    };
+
+    TEST_CASE("multiplexed connection is closed after an invalid frame") // NOLINT
+    {
+        namespace http = beast::http;
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8086;
+
+        auto f = std::make_shared<record_fail>();
+
+        net::io_context server_ioc {1};
+
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, record_fail>>(
+            server_ioc, tcp::endpoint {address, port}, true, f)
+            ->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+        websocket::stream<tcp::socket> ws {client_ioc};
+        ws.next_layer().connect(tcp::endpoint {address, port});
+        ws.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+            req.set(http::field::sec_websocket_protocol, beast_machine::mux::subprotocol);
+        }));
+        ws.handshake("127.0.0.1", "/");
+
+        // too short to hold a frame header
+        ws.binary(true);
+        ws.write(net::buffer(std::string("xx")));
+
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+        ws.read(buffer, ec);
+        t.join();
+
+        REQUIRE(ec == websocket::error::closed);                            // NOLINT
+        REQUIRE(ws.reason().code == websocket::close_code::protocol_error); // NOLINT
+        REQUIRE(f->what == "read");                                         // NOLINT
+    };
+
+    TEST_CASE("resumable conversation survives a dropped connection") // NOLINT
+    {
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8083;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        // the resumed conversation needs a second connection
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        using client_session = beast_machine::client::resumable_session<hello_world_task<environment::client>, fail>;
+        auto s = std::make_shared<client_session>(client_ioc, f);
+        s->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        // drop the connection while the client is streaming to the server
+        auto const start = hello_world_task<environment::client>::callback_count;
+        while (hello_world_task<environment::client>::callback_count < start + 50)
+        {
+            client_ioc.run_one();
+        }
+        s->disconnect();
+        s.reset();
+
+        client_ioc.run();
+
+        // the server finishes its end of the close handshake
+        REQUIRE(eventually([&l] { return l->stats().active_sessions == 0; })); // NOLINT
+
+        server_ioc.stop();
+        t.join();
+
+        REQUIRE(l->stats().sessions_resumed == 1); // NOLINT
+    };
+
+    TEST_CASE("resumable connection is dropped after an invalid frame") // NOLINT
+    {
+        namespace http = beast::http;
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8089;
+
+        auto f = std::make_shared<record_fail>();
+
+        net::io_context server_ioc {1};
+
+        std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, record_fail>>(
+            server_ioc, tcp::endpoint {address, port}, true, f)
+            ->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+        websocket::stream<tcp::socket> ws {client_ioc};
+        ws.next_layer().connect(tcp::endpoint {address, port});
+        ws.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+            req.set(http::field::sec_websocket_protocol, beast_machine::resume::subprotocol);
+        }));
+        ws.handshake("127.0.0.1", "/");
+
+        // the server has sent nothing yet that this frame could acknowledge, and it skips a sequence number
+        ws.binary(true);
+        ws.write(net::buffer(beast_machine::resume::encode_frame(beast_machine::resume::frame_type::data, 5, 0, "x")));
+
+        // the server's first frame arrives before the connection is dropped
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+        while (!ec)
+        {
+            ws.read(buffer, ec);
+        }
+        t.join();
+
+        REQUIRE(f->what == "sequence"); // NOLINT
+    };
+
+    // Forwards connections to a server. After a cut nothing more is forwarded on the connections open at
+    // the time, and the server's end of them stays open, as when the network between the two fails
+    class proxy : public std::enable_shared_from_this<proxy>
+    {
+        struct link
+        {
+            tcp::socket client;
+            tcp::socket server;
+            bool cut = false;
+        };
+
+        tcp::acceptor acceptor_;
+        tcp::endpoint target_;
+        std::vector<std::shared_ptr<link>> links_;
+
+    public:
+        proxy(net::io_context& ioc, tcp::endpoint endpoint, tcp::endpoint target)
+            : acceptor_(ioc, endpoint)
+            , target_(target)
+        {
+        }
+
+        void run() { do_accept(); }
+
+        void cut()
+        {
+            for (auto& l : links_)
+                l->cut = true;
+        }
+
+    private:
+        void do_accept()
+        {
+            acceptor_.async_accept([self = shared_from_this()](beast::error_code ec, tcp::socket socket) {
+                if (ec)
+                    return;
+
+                auto l = std::make_shared<link>(link {std::move(socket), tcp::socket {self->acceptor_.get_executor()}});
+                l->server.connect(self->target_);
+                self->links_.push_back(l);
+                pump(l, l->client, l->server);
+                pump(l, l->server, l->client);
+                self->do_accept();
+            });
+        }
+
+        static void pump(std::shared_ptr<link> l, tcp::socket& from, tcp::socket& to)
+        {
+            auto buffer = std::make_shared<std::array<char, 4096>>();
+            from.async_read_some(net::buffer(*buffer), [l, &from, &to, buffer](beast::error_code ec, std::size_t n) {
+                if (l->cut)
+                    return;
+
+                if (ec)
+                {
+                    beast::error_code ignored;
+                    to.shutdown(tcp::socket::shutdown_send, ignored);
+                    return;
+                }
+
+                net::async_write(to, net::buffer(*buffer, n), [l, &from, &to](beast::error_code ec, std::size_t) {
+                    if (!ec)
+                        pump(l, from, to);
+                });
+            });
+        }
+    };
+
+    TEST_CASE("resumable conversation is taken over from a connection the server still has open") // NOLINT
+    {
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8087;
+        auto const proxy_port = 8088;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->run();
+
+        auto p
+            = std::make_shared<proxy>(server_ioc, tcp::endpoint {address, proxy_port}, tcp::endpoint {address, port});
+        p->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        using client_session = beast_machine::client::resumable_session<hello_world_task<environment::client>, fail>;
+        auto s = std::make_shared<client_session>(client_ioc, f);
+        s->run(tcp::endpoint {address, proxy_port}, "127.0.0.1", "/");
+
+        auto const start = hello_world_task<environment::client>::callback_count;
+        while (hello_world_task<environment::client>::callback_count < start + 50)
+        {
+            client_ioc.run_one();
+        }
+
+        // the server does not hear that the client has gone
+        std::promise<void> cut;
+        net::post(server_ioc, [&] {
+            p->cut();
+            cut.set_value();
+        });
+        cut.get_future().wait();
+
+        s->disconnect();
+        s.reset();
+
+        client_ioc.run();
+
+        // the server finishes its end of the close handshake through the proxy
+        REQUIRE(eventually([&l] { return l->stats().active_sessions == 0; })); // NOLINT
+
+        server_ioc.stop();
+        t.join();
+
+        REQUIRE(l->stats().sessions_resumed == 1); // NOLINT
+    };
+
+    TEST_CASE("admission control turns new sessions away at the session limit") // NOLINT
+    {
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8084;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        beast_machine::server::admission_policy policy;
+        policy.max_sessions = 1;
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        // the first session is let in and waits for its hello
+        websocket::stream<beast::tcp_stream> first(client_ioc);
+        first.next_layer().connect(tcp::endpoint {address, port});
+        first.handshake("127.0.0.1", "/");
+
+        // the second is closed as soon as its handshake completes, which agrees to one of its subprotocols
+        websocket::stream<beast::tcp_stream> second(client_ioc);
+        second.next_layer().connect(tcp::endpoint {address, port});
+        second.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+            req.set(beast::http::field::sec_websocket_protocol, "first-choice, second-choice");
+        }));
+        websocket::response_type res;
+        second.handshake(res, "127.0.0.1", "/");
+        REQUIRE(res[beast::http::field::sec_websocket_protocol] == "first-choice"); // NOLINT
+
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+        second.read(buffer, ec);
+        REQUIRE(ec == websocket::error::closed);                                 // NOLINT
+        REQUIRE(second.reason().code == websocket::close_code::try_again_later); // NOLINT
+
+        first.close(websocket::close_code::normal);
+
+        server_ioc.stop();
+        t.join();
+
+        REQUIRE(l->stats().sessions_shed == 1); // NOLINT
+    };
+
+    TEST_CASE("admission control turns a multiplexing client away at the session limit") // NOLINT
+    {
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8094;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        beast_machine::server::admission_policy policy;
+        policy.max_sessions = 1;
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        websocket::stream<beast::tcp_stream> first(client_ioc);
+        first.next_layer().connect(tcp::endpoint {address, port});
+        first.handshake("127.0.0.1", "/");
+
+        // the multiplexing client is told why it was turned away
+        auto client_f = std::make_shared<record_fail>();
+        std::make_shared<beast_machine::client::mux_session<hello_world_task<environment::client>, record_fail>>(
+            client_ioc, client_f, 2)
+            ->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        client_ioc.run();
+
+        first.close(websocket::close_code::normal);
+
+        server_ioc.stop();
+        t.join();
+
+        REQUIRE(client_f->what == "handshake");                                          // NOLINT
+        REQUIRE(client_f->ec == make_error_code(beast_machine::errc::server_overloaded)); // NOLINT
+        REQUIRE(l->stats().sessions_shed == 1);                                          // NOLINT
+    };
+
+    TEST_CASE("admission control turns a resumable client away until a session ends") // NOLINT
+    {
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8095;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        beast_machine::server::admission_policy policy;
+        policy.max_sessions = 1;
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        websocket::stream<beast::tcp_stream> first(client_ioc);
+        first.next_layer().connect(tcp::endpoint {address, port});
+        first.handshake("127.0.0.1", "/");
+
+        using client_session = beast_machine::client::resumable_session<hello_world_task<environment::client>, fail>;
+        std::make_shared<client_session>(client_ioc, f)->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        // the resumable client backs off and tries again once the first session has gone
+        while (l->stats().sessions_shed == 0)
+        {
+            client_ioc.run_one();
+        }
+        first.close(websocket::close_code::normal);
+
+        client_ioc.run();
+
+        // the server finishes its end of the close handshake
+        REQUIRE(eventually([&l] { return l->stats().active_sessions == 0; })); // NOLINT
+
+        server_ioc.stop();
+        t.join();
+
+        // the first session, at least one that was shed and the one that was let in
+        REQUIRE(l->stats().websocket_upgrades == l->stats().sessions_shed + 2); // NOLINT
+    };
+
+    TEST_CASE("admission control sheds new sessions while overloaded but lets resumed ones in") // NOLINT
+    {
+        namespace http = beast::http;
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8092;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        // the memory in use is whatever the test says it is
+        std::atomic<std::size_t> memory {0};
+        beast_machine::server::admission_policy policy;
+        policy.max_memory = 1;
+        policy.memory_usage = [&memory] { return memory.load(); };
+        policy.probe_interval = std::chrono::milliseconds(10);
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        using client_session = beast_machine::client::resumable_session<hello_world_task<environment::client>, fail>;
+        auto s = std::make_shared<client_session>(client_ioc, f);
+        s->run(tcp::endpoint {address, port}, "127.0.0.1", "/");
+
+        auto const start = hello_world_task<environment::client>::callback_count;
+        while (hello_world_task<environment::client>::callback_count < start + 50)
+        {
+            client_ioc.run_one();
+        }
+
+        memory = 2;
+        REQUIRE(eventually([&l] { return l->stats().overloaded.load(); })); // NOLINT
+
+        net::io_context probe_ioc;
+
+        // load balancers are told to send new clients elsewhere, the health route is still answered
+        auto get = [&](char const* target) {
+            beast::tcp_stream stream(probe_ioc);
+            stream.connect(tcp::endpoint {address, port});
+
+            http::request<http::empty_body> req {http::verb::get, target, 11};
+            req.set(http::field::host, "127.0.0.1");
+            http::write(stream, req);
+
+            beast::flat_buffer buffer;
+            http::response<http::string_body> res;
+            http::read(stream, buffer, res);
+            return res.result();
+        };
+        REQUIRE(get("/ready") == http::status::service_unavailable); // NOLINT
+        REQUIRE(get("/health") == http::status::ok);                 // NOLINT
+
+        // a new conversation is turned away
+        websocket::stream<beast::tcp_stream> ws(probe_ioc);
+        ws.next_layer().connect(tcp::endpoint {address, port});
+        ws.handshake("127.0.0.1", "/");
+
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+        ws.read(buffer, ec);
+        REQUIRE(ec == websocket::error::closed);                             // NOLINT
+        REQUIRE(ws.reason().code == websocket::close_code::try_again_later); // NOLINT
+
+        // the conversation already running comes back over a new connection and is let in
+        s->disconnect();
+        s.reset();
+
+        client_ioc.run();
+
+        server_ioc.stop();
+        t.join();
+
+        REQUIRE(l->stats().sessions_shed == 1);    // NOLINT
+        REQUIRE(l->stats().sessions_resumed == 1); // NOLINT
+    };
+
+    TEST_CASE("admission control sheds new sessions while the event loop runs late") // NOLINT
+    {
+        namespace websocket = beast::websocket;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8093;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        beast_machine::server::admission_policy policy;
+        policy.max_loop_latency = std::chrono::milliseconds(5);
+        policy.probe_interval = std::chrono::milliseconds(1);
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        // slow handlers hold up the event loop until the server is stopped
+        std::function<void()> slow_handler = [&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            net::post(server_ioc, slow_handler);
+        };
+        net::post(server_ioc, slow_handler);
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        REQUIRE(eventually([&l] { return l->stats().overloaded.load(); })); // NOLINT
+        REQUIRE(l->stats().loop_latency_us > 5000);                         // NOLINT
+
+        net::io_context client_ioc;
+        websocket::stream<beast::tcp_stream> ws(client_ioc);
+        ws.next_layer().connect(tcp::endpoint {address, port});
+        ws.handshake("127.0.0.1", "/");
+
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+        ws.read(buffer, ec);
+        REQUIRE(ec == websocket::error::closed);                             // NOLINT
+        REQUIRE(ws.reason().code == websocket::close_code::try_again_later); // NOLINT
+
+        server_ioc.stop();
+        t.join();
+    };
+
+    TEST_CASE("admission control does not hold up connections behind idle keep alive connections") // NOLINT
+    {
+        namespace http = beast::http;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8091;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        beast_machine::server::admission_policy policy;
+        policy.max_handshakes = 1;
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, false, f);
+        l->set_admission_policy(policy);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+
+        auto get = [](beast::tcp_stream& stream, char const* target) {
+            http::request<http::empty_body> req {http::verb::get, target, 11};
+            req.set(http::field::host, "127.0.0.1");
+            http::write(stream, req);
+
+            beast::flat_buffer buffer;
+            http::response<http::string_body> res;
+            http::read(stream, buffer, res);
+            return res;
+        };
+
+        // a load balancer probe that keeps its connection open
+        beast::tcp_stream probe(client_ioc);
+        probe.connect(tcp::endpoint {address, port});
+        REQUIRE(get(probe, "/health").result() == http::status::ok); // NOLINT
+
+        // would wait in the listen backlog until the probe connection timed out
+        beast::tcp_stream other(client_ioc);
+        other.expires_after(std::chrono::seconds(5));
+        other.connect(tcp::endpoint {address, port});
+        REQUIRE(get(other, "/health").result() == http::status::ok); // NOLINT
+        REQUIRE(l->stats().handshakes_in_progress == 0);            // NOLINT
+
+        server_ioc.stop();
+        t.join();
+    };
+
+    TEST_CASE("token bucket limits the accept rate") // NOLINT
+    {
+        using namespace std::chrono_literals;
+
+        auto const now = std::chrono::steady_clock::now();
+        beast_machine::server::token_bucket bucket(10, 2, now);
+
+        // the burst is available straight away
+        REQUIRE(bucket.take(now) == std::chrono::steady_clock::duration::zero()); // NOLINT
+        REQUIRE(bucket.take(now) == std::chrono::steady_clock::duration::zero()); // NOLINT
+
+        // then one token every 100ms
+        auto wait = bucket.take(now);
+        REQUIRE(wait > 99ms);   // NOLINT
+        REQUIRE(wait <= 100ms); // NOLINT
+        REQUIRE(bucket.take(now + 50ms) > 49ms);                                          // NOLINT
+        REQUIRE(bucket.take(now + 100ms) == std::chrono::steady_clock::duration::zero()); // NOLINT
+
+        // and no more than the burst after a quiet spell
+        REQUIRE(bucket.take(now + 10s) == std::chrono::steady_clock::duration::zero()); // NOLINT
+        REQUIRE(bucket.take(now + 10s) == std::chrono::steady_clock::duration::zero()); // NOLINT
+        REQUIRE(bucket.take(now + 10s) != std::chrono::steady_clock::duration::zero()); // NOLINT
+    };
+
+    TEST_CASE("http fast path serves health readiness and stats") // NOLINT
+    {
+        namespace http = beast::http;
+
+        auto const address = net::ip::make_address("127.0.0.1");
+        auto const port = 8081;
+
+        auto f = std::make_shared<fail>();
+
+        net::io_context server_ioc {1};
+
+        auto l = std::make_shared<beast_machine::server::listener<hello_world_task<environment::server>, fail>>(
+            server_ioc, tcp::endpoint {address, port}, true, f);
+        l->set_ready(false);
+        l->run();
+
+        std::thread t([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+        beast::tcp_stream stream(client_ioc);
+        stream.connect(tcp::endpoint {address, port});
+
+        // all requests go over the one keep alive connection
+        auto get = [&stream](char const* target) {
+            http::request<http::empty_body> req {http::verb::get, target, 11};
+            req.set(http::field::host, "127.0.0.1");
+            http::write(stream, req);
+
+            beast::flat_buffer buffer;
+            http::response<http::string_body> res;
+            http::read(stream, buffer, res);
+            return res;
+        };
+
+        auto health = get("/health");
+        REQUIRE(health.result() == http::status::ok); // NOLINT
+        REQUIRE(health.body() == "ok");               // NOLINT
+
+        REQUIRE(get("/ready").result() == http::status::service_unavailable); // NOLINT
+        REQUIRE(get("/missing?x=1").result() == http::status::not_found);     // NOLINT
+
+        auto stats = get("/stats");
+        REQUIRE(stats.result() == http::status::ok);                                   // NOLINT
+        REQUIRE(stats.body().find("\"connections_accepted\":1") != std::string::npos); // NOLINT
+        REQUIRE(stats.body().find("\"http_requests\":4") != std::string::npos);        // NOLINT
+        auto backend = beast_machine::to_string(beast_machine::current_io_backend());
+        REQUIRE(stats.body().find(backend) != std::string::npos); // NOLINT
+        REQUIRE(l->stats().websocket_upgrades == 0);                                   // NOLINT
+
+        beast::error_code ec;
+        stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+        t.join();
+    };
 }